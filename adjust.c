@@ -162,6 +162,11 @@ void compare_world(struct compare_data *compare)
   translate_world(compare->world, &best_compare);
 }
 
+const struct vertex *compare_reference(const struct compare_data *compare)
+{
+  return compare->compare_vertices;
+}
+
 static void translate_world(struct world *world, const struct compare *compare) {
   struct translate_matrix m;
   make_translate(&m, compare);
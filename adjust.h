@@ -41,4 +41,7 @@ void compare_prepare_workers(struct compare_data *);
 
 void compare_world(struct compare_data *);
 
+// Reference positions, weight 0 for vertices missing from it
+const struct vertex *compare_reference(const struct compare_data *);
+
 #endif
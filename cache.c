@@ -0,0 +1,321 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "world.h"
+#include "rng.h"
+#include "cache.h"
+
+/*
+  Layout result cache.  A run is fully decided by the graph, the start
+  positions and the options that steer the steps, so --cache DIR keys
+  finished layouts by a hash of just those, taken after init_world and
+  before init_layout, so a hit skips all of the layout set up too.
+  That is also why --cache keeps the edges in the adjacency lists only,
+  and why the key has the --spectral flag rather than its positions.
+  The graph is hashed as it is held inside, vertices in id order with
+  their weights and the co-pick adjacency, so inputs that differ only
+  in key order, in which user picked what, or in anything else that
+  doesn't change the co-pick counts share an entry.  Output formatting
+  isn't part of the key: entries hold the final positions and are
+  written out like any other run's.
+
+  An entry is DIR/<key>.layout, written to a temporary file and
+  renamed into place, so concurrent writers of the same key just
+  replace one finished entry with an identical one and readers never
+  see half of one.  Hits touch their entry, and after each store the
+  least recently used entries are removed until the directory is back
+  under --cache-size.  Runs that --deadline cut short are not stored.
+*/
+
+#define CACHE_MAGIC "FLCACHE1"
+#define CACHE_SUFFIX ".layout"
+#define CACHE_STALE 3600	// seconds before a leftover temporary file is removed
+
+struct cache_header {
+  char magic[8];
+  uint64_t hash[2];
+  int32_t nitems, nlive;
+  int32_t aligned;	// positions went through the -r alignment
+  int32_t pad;
+};
+
+struct hasher {
+  uint64_t a, b;
+};
+
+static void hash_word(struct hasher *h, uint64_t word)
+{
+  h->a = splitmix64(h->a ^ word);
+  h->b = splitmix64(h->b+word*0xD6E8FEB86659FD93ULL);
+}
+
+static void hash_real(struct hasher *h, double value)
+{
+  uint64_t word;
+  memcpy(&word, &value, sizeof(word));
+  hash_word(h, word);
+}
+
+static void hash_bytes(struct hasher *h, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  hash_word(h, len);
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    hash_word(h, word);
+  }
+  uint64_t rest = 0;
+  memcpy(&rest, p, len);
+  hash_word(h, rest);
+}
+
+// The reference steers the final rotation, so its contents count
+static void hash_file(struct hasher *h, const char *path)
+{
+  char buf[65536];
+  size_t n;
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    hash_bytes(h, path, strlen(path));
+    return;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    hash_bytes(h, buf, n);
+  fclose(in);
+}
+
+void cache_key(const struct world *world, struct cache_key *key)
+{
+  const struct options *options = world->options;
+  struct hasher h = {
+    .a = splitmix64(1),
+    .b = splitmix64(2)
+  };
+  hash_bytes(&h, CACHE_MAGIC, strlen(CACHE_MAGIC));
+
+  hash_word(&h, options->iterations);
+  hash_word(&h, options->engine);
+  hash_word(&h, options->samples);
+  hash_word(&h, options->seed);
+  hash_word(&h, options->grain);
+  hash_word(&h, options->autotune);
+  hash_real(&h, options->deadline);
+  hash_word(&h, options->ensemble);
+  hash_real(&h, options->freeze);
+  hash_word(&h, options->mesh);
+  hash_word(&h, options->spectral);
+  hash_real(&h, world->maxmove);
+  hash_real(&h, world->cooling);
+  hash_real(&h, world->repulsioncap);
+  hash_word(&h, options->rotate_to != NULL);
+  if (options->rotate_to)
+    hash_file(&h, options->rotate_to);
+
+  hash_word(&h, world->nitems);
+  for (int i = 0; i < world->nitems; ++i) {
+    const struct vertex *v = &world->vertices[i];
+    hash_word(&h, world->mapping[i+1]);
+    hash_real(&h, v->weight);
+    hash_real(&h, v->pos.x);
+    hash_real(&h, v->pos.y);
+    hash_word(&h, world->adj_start[i+1]-world->adj_start[i]);
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      hash_word(&h, world->adj[k].j);
+      hash_real(&h, world->adj[k].weight);
+    }
+  }
+
+  key->hash[0] = h.a;
+  key->hash[1] = h.b;
+  snprintf(key->hex, sizeof(key->hex), "%016llx%016llx",
+	   (unsigned long long)h.a, (unsigned long long)h.b);
+}
+
+static char *entry_path(const char *dir, const char *name)
+{
+  size_t len = strlen(dir)+strlen(name)+2;
+  char *path = malloc(len);
+  snprintf(path, len, "%s/%s", dir, name);
+  return path;
+}
+
+// Reads the positions of an entry into the world, returns whether there was one
+int cache_load(struct world *world, const struct cache_key *key, int *aligned)
+{
+  char name[sizeof(key->hex)+sizeof(CACHE_SUFFIX)];
+  snprintf(name, sizeof(name), "%s%s", key->hex, CACHE_SUFFIX);
+  char *path = entry_path(world->options->cache, name);
+  struct cache_header header;
+  struct pair *pos = malloc(world->nlive*sizeof(struct pair));
+  size_t size = world->nlive*sizeof(struct pair);
+  int hit = 0;
+  FILE *in = fopen(path, "rb");
+  if (in) {
+    char extra;
+    hit = fread(&header, sizeof(header), 1, in) == 1
+      && !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic))
+      && header.hash[0] == key->hash[0] && header.hash[1] == key->hash[1]
+      && header.nitems == world->nitems && header.nlive == world->nlive
+      && fread(pos, 1, size, in) == size && fread(&extra, 1, 1, in) == 0;
+    fclose(in);
+  }
+  if (hit) {
+    for (int l = 0; l < world->nlive; ++l)
+      world->vertices[world->live[l]].pos = pos[l];
+    *aligned = header.aligned;
+    // Recently used entries are the last to go
+    utimensat(AT_FDCWD, path, NULL, 0);
+  }
+  free(pos);
+  free(path);
+  return hit;
+}
+
+struct cached_entry {
+  char *name;
+  off_t size;
+  struct timespec used;
+};
+
+static int entry_comparator(const void *a, const void *b)
+{
+  const struct cached_entry *e1 = a, *e2 = b;
+  if (e1->used.tv_sec != e2->used.tv_sec)
+    return e1->used.tv_sec < e2->used.tv_sec ? -1 : 1;
+  if (e1->used.tv_nsec != e2->used.tv_nsec)
+    return e1->used.tv_nsec < e2->used.tv_nsec ? -1 : 1;
+  return strcmp(e1->name, e2->name);
+}
+
+/*
+  Removes the least recently used entries until the rest fit in the
+  size limit, keeping the one just stored.  Other processes may be at
+  it at the same time, so entries that are already gone are skipped.
+*/
+static void evict(const char *dir, const char *keep, size_t limit)
+{
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  struct cached_entry *entries = NULL;
+  size_t nentries = 0, capacity = 0, total = 0;
+  time_t now = time(NULL);
+  if (!d)
+    return;
+  while ((ent = readdir(d))) {
+    size_t len = strlen(ent->d_name), suffix = strlen(CACHE_SUFFIX);
+    struct stat st;
+    char *path = entry_path(dir, ent->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+    // Left behind by writers that died before the rename
+    if (ent->d_name[0] == '.' && strstr(ent->d_name, CACHE_SUFFIX) && now-st.st_mtime > CACHE_STALE) {
+      unlink(path);
+      free(path);
+      continue;
+    }
+    free(path);
+    if (ent->d_name[0] == '.' || len <= suffix || strcmp(ent->d_name+len-suffix, CACHE_SUFFIX))
+      continue;
+    total += st.st_size;
+    if (!strcmp(ent->d_name, keep))
+      continue;
+    if (nentries == capacity) {
+      capacity = capacity ? 2*capacity : 64;
+      entries = realloc(entries, capacity*sizeof(struct cached_entry));
+    }
+    entries[nentries].name = strdup(ent->d_name);
+    entries[nentries].size = st.st_size;
+    entries[nentries].used = st.st_mtim;
+    ++nentries;
+  }
+  closedir(d);
+
+  qsort(entries, nentries, sizeof(struct cached_entry), entry_comparator);
+  for (size_t e = 0; e < nentries; ++e) {
+    if (total > limit) {
+      char *path = entry_path(dir, entries[e].name);
+      if (unlink(path) == 0 || errno == ENOENT)
+	total -= entries[e].size;
+      free(path);
+    }
+    free(entries[e].name);
+  }
+  free(entries);
+}
+
+void cache_store(const struct world *world, const struct cache_key *key, int aligned)
+{
+  const char *dir = world->options->cache;
+  char name[sizeof(key->hex)+sizeof(CACHE_SUFFIX)], tmpname[sizeof(name)+8];
+  snprintf(name, sizeof(name), "%s%s", key->hex, CACHE_SUFFIX);
+  snprintf(tmpname, sizeof(tmpname), ".%s.XXXXXX", name);
+  char *path = entry_path(dir, name), *tmppath = entry_path(dir, tmpname);
+  struct cache_header header = {
+    .magic = CACHE_MAGIC,
+    .hash = {key->hash[0], key->hash[1]},
+    .nitems = world->nitems,
+    .nlive = world->nlive,
+    .aligned = aligned
+  };
+  struct pair *pos = malloc(world->nlive*sizeof(struct pair));
+  for (int l = 0; l < world->nlive; ++l)
+    pos[l] = world->vertices[world->live[l]].pos;
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    fprintf(stderr, "forcelayout: can't create cache %s: %s\n", dir, strerror(errno));
+  int fd = mkstemp(tmppath);
+  // mkstemp makes the entry private, give it the mode a new file would get
+  mode_t mask = umask(0);
+  umask(mask);
+  if (fd >= 0)
+    fchmod(fd, 0666 & ~mask);
+  FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!out) {
+    fprintf(stderr, "forcelayout: can't write cache entry %s\n", path);
+  } else {
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1
+      && fwrite(pos, sizeof(struct pair), world->nlive, out) == (size_t)world->nlive;
+    if (fclose(out) != 0 || !ok || rename(tmppath, path) != 0) {
+      fprintf(stderr, "forcelayout: can't write cache entry %s\n", path);
+      unlink(tmppath);
+    } else {
+      evict(dir, name, world->options->cache_size);
+    }
+  }
+  free(pos);
+  free(path);
+  free(tmppath);
+}
@@ -0,0 +1,306 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "world.h"
+#include "force.h"
+#include "cluster.h"
+
+/*
+  Layout shared by several processes.  Every process loads the same
+  input and so has the same world; the work units are cut into
+  contiguous blocks of --ranks ranges and each process computes only
+  its own.  After each force step every rank sends its units' new
+  positions and partial sums to rank 0, which sends everything back
+  to everyone.  All ranks then add up the same partial sums in the same
+  order, so the layout matches a single process run bit for bit.
+
+  Rank 0 listens on --cluster, either unix:PATH or HOST:PORT, and goes
+  on to resolve overlaps and write the output.  The other ranks leave
+  after the force steps.
+*/
+
+#define CLUSTER_MAGIC 0x666c6179U
+#define CONNECT_TRIES 300	// a tenth of a second apart
+
+struct hello {
+  uint32_t magic;
+  int32_t rank, nranks, nitems, nunits;
+};
+
+struct unit_sums {
+  double energy, weight;
+  struct barycenter barycenter;
+};
+
+static void send_all(int fd, const void *buf, size_t len)
+{
+  const char *ptr = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      fprintf(stderr, "forcelayout: cluster send failed: %s\n", strerror(errno));
+      exit(1);
+    }
+    ptr += n;
+    len -= n;
+  }
+}
+
+static void recv_all(int fd, void *buf, size_t len)
+{
+  char *ptr = buf;
+  while (len > 0) {
+    ssize_t n = recv(fd, ptr, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      fprintf(stderr, "forcelayout: cluster peer went away\n");
+      exit(1);
+    }
+    ptr += n;
+    len -= n;
+  }
+}
+
+// Listening or connected socket for unix:PATH or HOST:PORT
+static int open_socket(const char *address, int listening)
+{
+  int fd = -1;
+  if (!strncmp(address, "unix:", 5)) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(address+5) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "forcelayout: socket path too long: %s\n", address+5);
+      exit(1);
+    }
+    strcpy(sun.sun_path, address+5);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listening) {
+      unlink(sun.sun_path);
+      if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, SOMAXCONN))
+	goto fail;
+    } else if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  const char *colon = strrchr(address, ':');
+  if (!colon) {
+    fprintf(stderr, "forcelayout: bad cluster address %s\n", address);
+    exit(1);
+  }
+  char *host = strndup(address, colon-address);
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+			   .ai_flags = listening ? AI_PASSIVE : 0}, *res;
+  int err = getaddrinfo(*host ? host : NULL, colon+1, &hints, &res);
+  free(host);
+  if (err) {
+    fprintf(stderr, "forcelayout: %s: %s\n", address, gai_strerror(err));
+    exit(1);
+  }
+  fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (listening) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, SOMAXCONN)) {
+      freeaddrinfo(res);
+      goto fail;
+    }
+  } else if (connect(fd, res->ai_addr, res->ai_addrlen)) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+
+ fail:
+  fprintf(stderr, "forcelayout: can't listen on %s: %s\n", address, strerror(errno));
+  exit(1);
+}
+
+static void unit_range(const struct cluster *cluster, int rank, int *first, int *last)
+{
+  *first = (long)rank*cluster->nunits/cluster->nranks;
+  *last = (long)(rank+1)*cluster->nunits/cluster->nranks;
+}
+
+void init_cluster(struct world *world)
+{
+  struct options *options = world->options;
+  struct cluster *cluster = malloc(sizeof(struct cluster));
+  struct hello hello = {
+    .magic = CLUSTER_MAGIC,
+    .rank = options->rank,
+    .nranks = options->ranks,
+    .nitems = world->nitems
+  };
+  for (struct world_work **workptr = world->world_work; *workptr; ++workptr)
+    ++hello.nunits;
+  cluster->nranks = options->ranks;
+  cluster->rank = options->rank;
+  cluster->nunits = hello.nunits;
+  unit_range(cluster, cluster->rank, &cluster->first, &cluster->last);
+
+  cluster->offsets = malloc((cluster->nunits+1)*sizeof(size_t));
+  cluster->offsets[0] = 0;
+  for (int u = 0; u < cluster->nunits; ++u) {
+    struct world_work *work = world->world_work[u];
+    cluster->offsets[u+1] = cluster->offsets[u]+sizeof(struct unit_sums)+(work->end-work->start)*sizeof(struct pair);
+  }
+  cluster->buf = malloc(cluster->offsets[cluster->nunits]);
+
+  if (cluster->rank == 0) {
+    int listener = open_socket(options->cluster, 1);
+    cluster->fds = malloc(cluster->nranks*sizeof(int));
+    for (int r = 1; r < cluster->nranks; ++r)
+      cluster->fds[r] = -1;
+    for (int r = 1; r < cluster->nranks; ++r) {
+      struct hello peer;
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0) {
+	fprintf(stderr, "forcelayout: cluster accept failed: %s\n", strerror(errno));
+	exit(1);
+      }
+      recv_all(fd, &peer, sizeof(peer));
+      if (peer.magic != CLUSTER_MAGIC || peer.nranks != hello.nranks || peer.rank <= 0 ||
+	  peer.rank >= hello.nranks || cluster->fds[peer.rank] >= 0 ||
+	  peer.nitems != hello.nitems || peer.nunits != hello.nunits) {
+	fprintf(stderr, "forcelayout: rank %i doesn't match rank 0 (%i items in %i units)\n",
+		peer.rank, peer.nitems, peer.nunits);
+	exit(1);
+      }
+      cluster->fds[peer.rank] = fd;
+    }
+    close(listener);
+    if (!strncmp(options->cluster, "unix:", 5))
+      unlink(options->cluster+5);
+  } else {
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < CONNECT_TRIES; ++tries) {
+      fd = open_socket(options->cluster, 0);
+      if (fd < 0)
+	usleep(100000);
+    }
+    if (fd < 0) {
+      fprintf(stderr, "forcelayout: can't reach rank 0 at %s\n", options->cluster);
+      exit(1);
+    }
+    cluster->fds = malloc(sizeof(int));
+    cluster->fds[0] = fd;
+    send_all(fd, &hello, sizeof(hello));
+  }
+
+  // Only this rank's units go through the pool
+  int nlocal = cluster->last-cluster->first;
+  world->local_work = malloc((nlocal+1)*sizeof(struct world_work *));
+  memcpy(world->local_work, world->world_work+cluster->first, nlocal*sizeof(struct world_work *));
+  world->local_work[nlocal] = NULL;
+  world->cluster = cluster;
+  if (options->verbose)
+    fprintf(stderr, "cluster: rank %i of %i, items %i-%i\n", cluster->rank, cluster->nranks,
+	    cluster->first < cluster->nunits ? world->world_work[cluster->first]->start : 0,
+	    cluster->last > 0 ? world->world_work[cluster->last-1]->end : 0);
+}
+
+static void pack_units(struct world *world, int first, int last)
+{
+  struct cluster *cluster = world->cluster;
+  for (int u = first; u < last; ++u) {
+    struct world_work *work = world->world_work[u];
+    struct unit_sums *sums = (struct unit_sums *)(cluster->buf+cluster->offsets[u]);
+    sums->energy = work->energy;
+    sums->weight = work->weight;
+    sums->barycenter = *(struct barycenter *)work->extra;
+    memcpy(sums+1, work->data, (work->end-work->start)*sizeof(struct pair));
+  }
+}
+
+static void unpack_units(struct world *world, int first, int last)
+{
+  struct cluster *cluster = world->cluster;
+  for (int u = first; u < last; ++u) {
+    struct world_work *work = world->world_work[u];
+    struct unit_sums *sums = (struct unit_sums *)(cluster->buf+cluster->offsets[u]);
+    work->energy = sums->energy;
+    work->weight = sums->weight;
+    *(struct barycenter *)work->extra = sums->barycenter;
+    memcpy(work->data, sums+1, (work->end-work->start)*sizeof(struct pair));
+  }
+}
+
+// Leaves every unit's new positions and partial sums in world_work on every rank
+void cluster_exchange(struct world *world)
+{
+  struct cluster *cluster = world->cluster;
+  const size_t *offsets = cluster->offsets;
+  int first, last;
+  if (cluster->rank == 0) {
+    for (int r = 1; r < cluster->nranks; ++r) {
+      unit_range(cluster, r, &first, &last);
+      recv_all(cluster->fds[r], cluster->buf+offsets[first], offsets[last]-offsets[first]);
+      unpack_units(world, first, last);
+    }
+    pack_units(world, cluster->first, cluster->last);
+    for (int r = 1; r < cluster->nranks; ++r)
+      send_all(cluster->fds[r], cluster->buf, offsets[cluster->nunits]);
+  } else {
+    pack_units(world, cluster->first, cluster->last);
+    send_all(cluster->fds[0], cluster->buf+offsets[cluster->first], offsets[cluster->last]-offsets[cluster->first]);
+    recv_all(cluster->fds[0], cluster->buf, offsets[cluster->nunits]);
+    unpack_units(world, 0, cluster->first);
+    unpack_units(world, cluster->last, cluster->nunits);
+  }
+}
+
+void free_cluster(struct world *world)
+{
+  struct cluster *cluster = world->cluster;
+  if (cluster->rank == 0) {
+    for (int r = 1; r < cluster->nranks; ++r)
+      close(cluster->fds[r]);
+  } else {
+    close(cluster->fds[0]);
+  }
+  free(cluster->fds);
+  free(cluster->buf);
+  free(cluster->offsets);
+  free(world->local_work);
+  world->local_work = world->world_work;
+  free(cluster);
+  world->cluster = NULL;
+}
@@ -0,0 +1,41 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _CLUSTER_H
+#define _CLUSTER_H
+
+#include "world.h"
+
+struct cluster {
+  int nranks, rank;
+  int *fds;		// rank 0: index rank, others: fds[0] is rank 0
+  int first, last;	// units this rank computes
+  int nunits;
+  char *buf;		// every unit, packed
+  size_t *offsets;	// index: unit, mirrors buf
+};
+
+void init_cluster(struct world *);
+void cluster_exchange(struct world *);
+void free_cluster(struct world *);
+
+#endif
@@ -0,0 +1,183 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "world.h"
+#include "force.h"
+#include "deadline.h"
+
+/*
+  --deadline gives the whole run a wall clock budget, counted from the
+  start of the process.  Tuning and the ensemble may only use its
+  start.  What loading, tuning and the ensemble leave of it is split
+  between the force iterations, the overlap resolution and the
+  alignment and output.  The force phase
+  measures its step time and sets the cooling so that the iterations
+  which fit still end at the maxmove the full schedule would reach.
+  The overlap loop is cut off at its share and the least overlapping
+  layout it saw gets written.
+*/
+
+#define FORCE_SHARE 0.7
+#define SPARSIFY_SHARE 0.2	// the rest is for alignment and output
+#define TUNE_SHARE 0.1		// of the whole budget, at most, before the shares are cut
+#define ENSEMBLE_SHARE 0.35	// likewise, the ensemble stops by then
+#define MIN_COOLING 0.5
+
+double monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+// When --autotune has to stop probing
+double deadline_tune_end(const struct options *options, double start)
+{
+  return start+options->deadline*TUNE_SHARE;
+}
+
+// When --ensemble has to settle on a candidate
+double deadline_ensemble_end(const struct options *options, double start)
+{
+  return start+options->deadline*ENSEMBLE_SHARE;
+}
+
+void init_deadline(struct deadline *deadline, struct world *world, double start, int iterations)
+{
+  double budget = world->options->deadline;
+  // Without alignment, overlap resolution may use half of its share too
+  double sparsify_share = SPARSIFY_SHARE;
+  if (!world->options->rotate_to)
+    sparsify_share += (1-FORCE_SHARE-SPARSIFY_SHARE)/2;
+  double now = monotonic_time(), left = start+budget-now;
+  if (left < 0)
+    left = 0;
+  memset(deadline, 0, sizeof(*deadline));
+  deadline->start = start;
+  deadline->force_end = now+left*FORCE_SHARE;
+  deadline->sparsify_end = deadline->force_end+left*sparsify_share;
+  deadline->end = start+budget;
+  deadline->iterations = iterations;
+  deadline->target_maxmove = world->maxmove*pow(world->cooling, deadline->iterations);
+  deadline->best_overlap = INFINITY;
+}
+
+// Whether to take another force step, with the cooling adapted to the steps left
+int deadline_force_step(struct deadline *deadline, struct world *world)
+{
+  double now = monotonic_time();
+  int done = deadline->force_steps;
+  if (done >= deadline->iterations || now >= deadline->force_end)
+    return 0;
+  if (done == 0) {
+    deadline->step_start = now;
+  } else {
+    double per_step = (now-deadline->step_start)/done;
+    double fit = (deadline->force_end-now)/per_step;
+    if (fit > deadline->iterations-done)
+      fit = deadline->iterations-done;
+    if (fit >= 1) {
+      world->cooling = pow(deadline->target_maxmove/world->maxmove, 1/fit);
+      if (world->cooling < MIN_COOLING)
+	world->cooling = MIN_COOLING;
+      if (world->cooling > COOLING)
+	world->cooling = COOLING;
+    }
+  }
+  ++deadline->force_steps;
+  return 1;
+}
+
+/*
+  Whether to take another overlap step.  The overlap a step reports is
+  that of the layout it started from, and every overlapping vertex is
+  examined, so that layout is kept aside until the step is done and
+  then kept if it overlaps least so far.
+*/
+int deadline_sparsify_step(struct deadline *deadline, struct world *world)
+{
+  if (monotonic_time() >= deadline->sparsify_end)
+    return 0;
+  if (!deadline->candidate) {
+    deadline->candidate = malloc(world->nitems*sizeof(struct pair));
+    deadline->best = malloc(world->nitems*sizeof(struct pair));
+  }
+  for (int i = 0; i < world->nitems; ++i)
+    deadline->candidate[i] = world->vertices[i].pos;
+  ++deadline->sparsify_steps;
+  return 1;
+}
+
+void deadline_sparsified(struct deadline *deadline, double overlap)
+{
+  deadline->overlap = overlap;
+  if (overlap < deadline->best_overlap) {
+    struct pair *best = deadline->best;
+    deadline->best = deadline->candidate;
+    deadline->candidate = best;
+    deadline->best_overlap = overlap;
+  }
+}
+
+// Unless the last step found nothing left to resolve, goes back to the best layout measured
+void deadline_finish_sparsify(struct deadline *deadline, struct world *world)
+{
+  if (deadline->sparsify_steps && deadline->overlap > 0) {
+    for (int i = 0; i < world->nitems; ++i)
+      world->vertices[i].pos = deadline->best[i];
+    deadline->overlap = deadline->best_overlap;
+  }
+  free(deadline->candidate);
+  free(deadline->best);
+  deadline->candidate = deadline->best = NULL;
+}
+
+int deadline_align(struct deadline *deadline)
+{
+  deadline->aligned = monotonic_time() < deadline->end;
+  return deadline->aligned;
+}
+
+// Whether the run got as far as one without a deadline would have
+int deadline_complete(const struct deadline *deadline, const struct world *world)
+{
+  return deadline->force_steps >= deadline->iterations
+    && deadline->sparsify_steps && deadline->overlap <= 0
+    && (deadline->aligned || !world->options->rotate_to);
+}
+
+void deadline_report(const struct deadline *deadline, const struct world *world)
+{
+  fprintf(stderr, "deadline: %i/%i force steps, maxmove %g (schedule ends at %g), "
+	  "%i overlap steps, overlap %g left, %s, %.3fs of %.3fs\n",
+	  deadline->force_steps, deadline->iterations, world->maxmove, deadline->target_maxmove,
+	  deadline->sparsify_steps, deadline->sparsify_steps ? deadline->overlap : INFINITY,
+	  deadline->aligned ? "aligned" : world->options->rotate_to ? "alignment skipped" : "no alignment",
+	  monotonic_time()-deadline->start, deadline->end-deadline->start);
+}
@@ -0,0 +1,56 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _DEADLINE_H
+#define _DEADLINE_H
+
+#include "world.h"
+
+struct deadline {
+  double start;
+  double force_end;	// force iterations stop here
+  double sparsify_end;	// overlap resolution stops here
+  double end;		// alignment is skipped past this
+  double step_start;	// when the first timed force step began
+  double target_maxmove;	// where the full schedule would end
+  int iterations;	// as many as the full schedule
+  int force_steps, sparsify_steps;
+  int aligned;
+  double overlap;	// left in the emitted layout
+  struct pair *candidate;	// layout before the current overlap step
+  struct pair *best;	// least overlapping layout measured
+  double best_overlap;
+};
+
+double monotonic_time(void);
+double deadline_tune_end(const struct options *, double);
+double deadline_ensemble_end(const struct options *, double);
+void init_deadline(struct deadline *, struct world *, double, int);
+int deadline_force_step(struct deadline *, struct world *);
+int deadline_sparsify_step(struct deadline *, struct world *);
+void deadline_sparsified(struct deadline *, double);
+void deadline_finish_sparsify(struct deadline *, struct world *);
+int deadline_align(struct deadline *);
+int deadline_complete(const struct deadline *, const struct world *);
+void deadline_report(const struct deadline *, const struct world *);
+
+#endif
@@ -0,0 +1,376 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "dtoa.h"
+
+/*
+  Shortest round-trip double formatting, after Florian Loitsch's
+  Grisu2.  The digits produced always read back to the same double
+  and are the shortest such string for all but a tiny fraction of
+  inputs, where one digit more is emitted.  This is several times
+  faster than looping over snprintf precisions and checking the
+  result with strtod.
+*/
+
+struct diy_fp {
+  uint64_t f;
+  int e;
+};
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+// Normalized 64 bit approximations of 10^k for k = -348, -340, ..., 340
+static const uint64_t cached_powers_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t cached_powers_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t pow10_u64[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL,
+  10000000000000000000ULL
+};
+
+static struct diy_fp diy_fp_from_double(double d)
+{
+  union {
+    double d;
+    uint64_t u;
+  } u = { .d = d };
+  struct diy_fp res;
+  int biased_e = (u.u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE;
+  uint64_t significand = u.u & DP_SIGNIFICAND_MASK;
+  if (biased_e != 0) {
+    res.f = significand + DP_HIDDEN_BIT;
+    res.e = biased_e - DP_EXPONENT_BIAS;
+  } else {
+    res.f = significand;
+    res.e = DP_MIN_EXPONENT + 1;
+  }
+  return res;
+}
+
+static struct diy_fp diy_fp_mul(struct diy_fp a, struct diy_fp b)
+{
+  unsigned __int128 p = (unsigned __int128)a.f*b.f;
+  struct diy_fp res = {
+    .f = (uint64_t)(p >> 64),
+    .e = a.e+b.e+64
+  };
+  // Round to nearest
+  if ((uint64_t)p & (1ULL << 63))
+    ++res.f;
+  return res;
+}
+
+static struct diy_fp diy_fp_normalize(struct diy_fp x)
+{
+  int s = __builtin_clzll(x.f);
+  x.f <<= s;
+  x.e -= s;
+  return x;
+}
+
+static void normalized_boundaries(struct diy_fp v, struct diy_fp *minus, struct diy_fp *plus)
+{
+  struct diy_fp pl = {
+    .f = (v.f << 1)+1,
+    .e = v.e-1
+  }, mi;
+  pl = diy_fp_normalize(pl);
+  if (v.f == DP_HIDDEN_BIT) {
+    mi.f = (v.f << 2)-1;
+    mi.e = v.e-2;
+  } else {
+    mi.f = (v.f << 1)-1;
+    mi.e = v.e-1;
+  }
+  mi.f <<= mi.e-pl.e;
+  mi.e = pl.e;
+  *minus = mi;
+  *plus = pl;
+}
+
+static struct diy_fp cached_power(int e, int *k)
+{
+  // Pick a power of ten that brings the exponent into [-60, -32]
+  double dk = (-61-e)*0.30102999566398114+347;
+  int ik = (int)dk;
+  if (ik != dk)
+    ++ik;
+  unsigned index = (unsigned)((ik >> 3)+1);
+  struct diy_fp res = {
+    .f = cached_powers_f[index],
+    .e = cached_powers_e[index]
+  };
+  *k = -(-348+(int)(index << 3));
+  return res;
+}
+
+static void grisu_round(char *buffer, int len, uint64_t delta, uint64_t rest,
+			uint64_t ten_kappa, uint64_t wp_w)
+{
+  while (rest < wp_w && delta-rest >= ten_kappa &&
+	 (rest+ten_kappa < wp_w || wp_w-rest > rest+ten_kappa-wp_w)) {
+    --buffer[len-1];
+    rest += ten_kappa;
+  }
+}
+
+static int count_decimal_digits(uint32_t n)
+{
+  int digits = 1;
+  while (digits < 10 && n >= pow10_u64[digits])
+    ++digits;
+  return digits;
+}
+
+static void digit_gen(struct diy_fp w, struct diy_fp mp, uint64_t delta,
+		      char *buffer, int *len, int *k)
+{
+  struct diy_fp one = {
+    .f = 1ULL << -mp.e,
+    .e = mp.e
+  };
+  uint64_t wp_w = mp.f-w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f-1);
+  int kappa = count_decimal_digits(p1);
+  *len = 0;
+
+  while (kappa > 0) {
+    uint32_t d = p1/pow10_u64[kappa-1];
+    p1 %= pow10_u64[kappa-1];
+    if (d || *len)
+      buffer[(*len)++] = '0'+d;
+    --kappa;
+    uint64_t tmp = ((uint64_t)p1 << -one.e)+p2;
+    if (tmp <= delta) {
+      *k += kappa;
+      grisu_round(buffer, *len, delta, tmp, pow10_u64[kappa] << -one.e, wp_w);
+      return;
+    }
+  }
+
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || *len)
+      buffer[(*len)++] = '0'+d;
+    p2 &= one.f-1;
+    --kappa;
+    if (p2 < delta) {
+      *k += kappa;
+      grisu_round(buffer, *len, delta, p2, one.f,
+		  -kappa < 20 ? wp_w*pow10_u64[-kappa] : 0);
+      return;
+    }
+  }
+}
+
+// Digits of a positive finite value: buffer*10^k
+static int grisu2(double value, char *buffer, int *k)
+{
+  struct diy_fp v = diy_fp_from_double(value), w_m, w_p;
+  int len;
+  normalized_boundaries(v, &w_m, &w_p);
+  struct diy_fp c_mk = cached_power(w_p.e, k);
+  struct diy_fp w = diy_fp_mul(diy_fp_normalize(v), c_mk);
+  struct diy_fp wp = diy_fp_mul(w_p, c_mk);
+  struct diy_fp wm = diy_fp_mul(w_m, c_mk);
+  ++wm.f;
+  --wp.f;
+  digit_gen(w, wp, wp.f-wm.f, buffer, &len, k);
+  return len;
+}
+
+static int write_exponent(char *buffer, int k)
+{
+  char *p = buffer;
+  if (k < 0) {
+    *p++ = '-';
+    k = -k;
+  }
+  if (k >= 100) {
+    *p++ = '0'+k/100;
+    k %= 100;
+    *p++ = '0'+k/10;
+    *p++ = '0'+k%10;
+  } else if (k >= 10) {
+    *p++ = '0'+k/10;
+    *p++ = '0'+k%10;
+  } else {
+    *p++ = '0'+k;
+  }
+  return p-buffer;
+}
+
+// Lay out length digits with decimal exponent k as a JSON real
+static int prettify(char *buffer, int length, int k)
+{
+  const int kk = length+k;	// 10^(kk-1) <= v < 10^kk
+  if (length <= kk && kk <= 21) {
+    // 1234e7 -> 12340000000.0
+    for (int i = length; i < kk; ++i)
+      buffer[i] = '0';
+    buffer[kk] = '.';
+    buffer[kk+1] = '0';
+    return kk+2;
+  } else if (0 < kk && kk <= 21) {
+    // 1234e-2 -> 12.34
+    memmove(&buffer[kk+1], &buffer[kk], length-kk);
+    buffer[kk] = '.';
+    return length+1;
+  } else if (-6 < kk && kk <= 0) {
+    // 1234e-6 -> 0.001234
+    const int offset = 2-kk;
+    memmove(&buffer[offset], &buffer[0], length);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    for (int i = 2; i < offset; ++i)
+      buffer[i] = '0';
+    return length+offset;
+  } else if (length == 1) {
+    // 1e30
+    buffer[1] = 'e';
+    return 2+write_exponent(&buffer[2], kk-1);
+  } else {
+    // 1234e30 -> 1.234e33
+    memmove(&buffer[2], &buffer[1], length-1);
+    buffer[1] = '.';
+    buffer[length+1] = 'e';
+    return length+2+write_exponent(&buffer[length+2], kk-1);
+  }
+}
+
+/*
+  Writes the shortest representation of a double that reads back
+  unchanged.  The result always has a decimal point or an exponent,
+  so that JSON readers take it as a real and not as an integer.
+  Returns the length written, buffer isn't NUL terminated.
+*/
+int format_double(char *buffer, double value)
+{
+  char *p = buffer;
+  int k;
+  if (!isfinite(value)) {
+    memcpy(buffer, "null", 4);
+    return 4;
+  }
+  if (signbit(value)) {
+    *p++ = '-';
+    value = -value;
+  }
+  if (value == 0) {
+    memcpy(p, "0.0", 3);
+    return p-buffer+3;
+  }
+  int len = grisu2(value, p, &k);
+  return p-buffer+prettify(p, len, k);
+}
+
+/*
+  Writes a double with a fixed number of digits after the decimal
+  point, 1 <= precision <= 17.  Values that don't fit a 53 bit integer
+  after scaling go through snprintf and anything too large for that
+  to be compact falls back to format_double.
+*/
+int format_fixed(char *buffer, double value, int precision)
+{
+  char digits[24];
+  char *p = buffer;
+  if (!isfinite(value) || fabs(value) >= 1e15)
+    return format_double(buffer, value);
+  double scaled = fabs(value)*pow10_u64[precision];
+  if (scaled >= 9007199254740992.0)
+    return snprintf(buffer, DTOA_MAXLEN+precision+1, "%.*f", precision, value);
+  uint64_t n = (uint64_t)(scaled+0.5);
+  if (value < 0 && n)
+    *p++ = '-';
+  int len = 0;
+  do {
+    digits[len++] = '0'+n%10;
+    n /= 10;
+  } while (n);
+  while (len <= precision)
+    digits[len++] = '0';
+  while (len > precision)
+    *p++ = digits[--len];
+  *p++ = '.';
+  while (len > 0)
+    *p++ = digits[--len];
+  return p-buffer;
+}
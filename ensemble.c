@@ -0,0 +1,210 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "world.h"
+#include "force.h"
+#include "worker.h"
+#include "grid.h"
+#include "nlist.h"
+#include "pairwise.h"
+#include "sampled.h"
+#include "mesh.h"
+#include "rng.h"
+#include "deadline.h"
+#include "ensemble.h"
+
+/*
+  Some starts end up tangled.  --ensemble K lays out K starts at once,
+  the first one being the usual rings and the others the same rings
+  with the vertices shuffled around them.  The pool's threads are
+  split between them.  Every ENSEMBLE_CHECKPOINT steps the candidates
+  are compared by energy and those clearly worse than the best are
+  dropped.  The last one left is copied back and carries on with all
+  the threads.  When time runs out first, the best one so far does.
+*/
+
+#define ENSEMBLE_CHECKPOINT 50
+#define ENSEMBLE_MARGIN 0.05	// worse than the best by this much gets dropped
+#define ENSEMBLE_STREAM (~0ULL)	// rng stream apart from the engines' per step ones
+
+struct candidate {
+  struct world *world;
+  int index;
+  int steps;
+  double energy;
+};
+
+static struct world *clone_world(const struct world *world, int nthreads)
+{
+  struct world *clone = malloc(sizeof(struct world));
+  *clone = *world;
+  clone->pool = init_workers(nthreads);
+  clone->vertices = malloc(world->nitems*sizeof(struct vertex));
+  memcpy(clone->vertices, world->vertices, world->nitems*sizeof(struct vertex));
+  init_force(clone);
+  init_freeze(clone);
+  clone->live_pos = malloc(world->nlive*sizeof(struct pair));
+  init_grid(clone);
+  init_nlist(clone);
+  if (world->options->engine == ENGINE_PAIRWISE)
+    init_pairwise(clone);
+  else if (world->options->engine == ENGINE_SAMPLED)
+    init_sampled(clone);
+  else if (world->options->engine == ENGINE_MESH)
+    init_mesh(clone);
+  return clone;
+}
+
+static void free_clone(struct world *clone)
+{
+  free_workers(clone->pool);
+  free_force(clone);
+  free(clone->quiet);
+  free(clone->moved);
+  free(clone->live_pos);
+  free_grid(clone->grid);
+  free_nlist(clone->nlist);
+  if (clone->options->engine == ENGINE_PAIRWISE)
+    free_pairwise(clone);
+  else if (clone->options->engine == ENGINE_SAMPLED)
+    free(clone->force);
+  else if (clone->options->engine == ENGINE_MESH)
+    free_mesh(clone);
+  free(clone->vertices);
+  free(clone);
+}
+
+// Shuffles the live vertices' start positions
+static void shuffle_start(struct world *world, int index)
+{
+  struct rng rng;
+  rng_seed(&rng, world->options->seed, ENSEMBLE_STREAM, index);
+  for (int k = world->nlive-1; k > 0; --k) {
+    int a = world->live[k], b = world->live[rng_below(&rng, k+1)];
+    struct pair pos = world->vertices[a].pos;
+    world->vertices[a].pos = world->vertices[b].pos;
+    world->vertices[b].pos = pos;
+  }
+}
+
+static void *run_candidate(void *ptr)
+{
+  struct candidate *candidate = ptr;
+  for (int i = 0; i < candidate->steps; ++i)
+    candidate->energy = world_step(candidate->world);
+  return NULL;
+}
+
+static int candidate_comparator(const void *a, const void *b)
+{
+  const struct candidate *c1 = a, *c2 = b;
+  if (c1->energy != c2->energy)
+    return c1->energy < c2->energy ? -1 : 1;
+  return c1->index-c2->index;
+}
+
+// Returns the number of force steps taken, no more than fit before until
+int run_ensemble(struct world *world, double until)
+{
+  struct options *options = world->options;
+  int ncandidates = options->ensemble;
+  int nthreads = worker_count(world->pool)/ncandidates;
+  int step = 0;
+  double per_step = 0;	// wall time of an ensemble step, once measured
+  struct candidate *candidates = malloc(ncandidates*sizeof(struct candidate));
+  pthread_t *threads = malloc(ncandidates*sizeof(pthread_t));
+
+  if (nthreads < 1)
+    nthreads = 1;
+  for (int c = 0; c < ncandidates; ++c) {
+    candidates[c].world = clone_world(world, nthreads);
+    candidates[c].index = c;
+    candidates[c].energy = 0;
+    if (c > 0)
+      shuffle_start(candidates[c].world, c);
+  }
+
+  while (ncandidates > 1 && step < options->iterations) {
+    // Up to the next checkpoint, a single step until the step time is known
+    int steps = ENSEMBLE_CHECKPOINT-step%ENSEMBLE_CHECKPOINT;
+    if (steps > options->iterations-step)
+      steps = options->iterations-step;
+    double now = monotonic_time();
+    if (now >= until)
+      break;
+    if (per_step == 0)
+      steps = 1;
+    else if (now+steps*per_step > until)
+      steps = (until-now)/per_step;
+    if (steps < 1)
+      break;
+    for (int c = 0; c < ncandidates; ++c) {
+      candidates[c].steps = steps;
+      pthread_create(&threads[c], NULL, run_candidate, &candidates[c]);
+    }
+    for (int c = 0; c < ncandidates; ++c)
+      pthread_join(threads[c], NULL);
+    step += steps;
+    per_step = (monotonic_time()-now)/steps;
+
+    qsort(candidates, ncandidates, sizeof(struct candidate), candidate_comparator);
+    if (step%ENSEMBLE_CHECKPOINT != 0 && step < options->iterations)
+      continue;
+    int keep = 1;
+    while (keep < ncandidates && candidates[keep].energy <= candidates[0].energy*(1+ENSEMBLE_MARGIN))
+      ++keep;
+    if (options->verbose) {
+      for (int c = 0; c < ncandidates; ++c)
+	fprintf(stderr, "ensemble: step %i candidate %i energy %f%s\n", step,
+		candidates[c].index, candidates[c].energy, c < keep ? "" : " dropped");
+    }
+    for (int c = keep; c < ncandidates; ++c)
+      free_clone(candidates[c].world);
+    ncandidates = keep;
+  }
+
+  // The best one carries on in world, with the whole pool
+  struct world *best = candidates[0].world;
+  memcpy(world->vertices, best->vertices, world->nitems*sizeof(struct vertex));
+  world->step = best->step;
+  world->maxmove = best->maxmove;
+  world->cooling = best->cooling;
+  world->repulsioncap = best->repulsioncap;
+  world->nlist->valid = 0;
+  if (world->quiet) {
+    memcpy(world->quiet, best->quiet, world->nitems);
+    memcpy(world->moved, best->moved, world->nitems);
+  }
+  if (options->verbose)
+    fprintf(stderr, "ensemble: continuing with candidate %i\n", candidates[0].index);
+  for (int c = 0; c < ncandidates; ++c)
+    free_clone(candidates[c].world);
+  free(candidates);
+  free(threads);
+  return step;
+}
@@ -30,27 +30,40 @@
 #include <sys/mman.h>
 #include "world.h"
 #include "worker.h"
+#include "force.h"
+#include "pairwise.h"
+#include "sampled.h"
+#include "mesh.h"
+#include "cluster.h"
 
-#define COOLING 0.995
 #define REPULSION_CAP_CHANGE 1.15
-
-struct barycenter {
-  long double x, y;
-};
+#define WORK_UNIT_BYTES 512
+#define FREEZE_WAKE 2	// in freeze distances, moves that wake the graph neighbours
+#define FREEZE_SWEEP 25	// every this many steps frozen vertices get computed too
 
 static double count_energy(struct world *, struct pair *, struct pair *, int);
+static double apply_force(struct world *, struct pair *, struct pair, struct pair *);
+static void gather_positions(struct world *);
+
+// Vertices per work unit, by default what fits in WORK_UNIT_BYTES
+int work_grain(const struct options *options)
+{
+  if (options->grain > 0)
+    return options->grain;
+  return (WORK_UNIT_BYTES-sizeof(struct world_work))/sizeof(struct pair);
+}
 
 void init_force(struct world *world)
 {
   int start = 0;
-  long pagesize = sysconf(_SC_PAGESIZE);
-  pagesize=512;
-  int items_per_unit =(pagesize-sizeof(struct world_work))/sizeof(struct pair);
-  int nbufs = world->nitems/items_per_unit+1;
+  int items_per_unit = work_grain(world->options);
+  size_t bufsize = sizeof(struct world_work)+items_per_unit*sizeof(struct pair);
+  int nbufs = (world->nitems+items_per_unit-1)/items_per_unit;
   struct world_work **work = malloc((nbufs+1)*sizeof(struct world_work **));
   work[nbufs] = NULL;
+  world->local_work = work;
   for (struct world_work **workptr = work; start < world->nitems; ++workptr) {
-    struct world_work *buf = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct world_work *buf = mmap(NULL, bufsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     buf->extra = malloc(sizeof(struct barycenter));
     buf->start = start;
     start += items_per_unit;
@@ -60,6 +73,74 @@ void init_force(struct world *world)
   world->world_work = work;
 }
 
+// Drops the work units, for init_force again with another grain
+void free_force(struct world *world)
+{
+  size_t bufsize = sizeof(struct world_work)+work_grain(world->options)*sizeof(struct pair);
+  for (struct world_work **workptr = world->world_work; *workptr; ++workptr) {
+    free((*workptr)->extra);
+    munmap(*workptr, bufsize);
+  }
+  if (world->local_work != world->world_work)
+    free(world->local_work);
+  free(world->world_work);
+  world->world_work = world->local_work = NULL;
+}
+
+/*
+  Late in a run most vertices barely move.  With --freeze, a vertex
+  which has moved less than the freeze distance for FREEZE_STEPS steps
+  is left where it is and its force isn't computed, until a graph
+  neighbour of it moves FREEZE_WAKE freeze distances or a periodic
+  sweep step finds it moving again.
+*/
+void init_freeze(struct world *world)
+{
+  if (world->options->freeze > 0) {
+    world->quiet = calloc(world->nitems, 1);
+    world->moved = calloc(world->nitems, 1);
+  } else {
+    world->quiet = world->moved = NULL;
+  }
+  world->sweep = 0;
+  world->nfrozen = 0;
+}
+
+static void track_motion(struct world *world, int i, const struct pair *newpos)
+{
+  if (!world->quiet)
+    return;
+  const struct pair *pos = &world->vertices[i].pos;
+  double move = hypot(newpos->x-pos->x, newpos->y-pos->y);
+  world->moved[i] = move >= FREEZE_WAKE*world->options->freeze;
+  if (move >= world->options->freeze)
+    world->quiet[i] = 0;
+  else if (world->quiet[i] < 255)
+    ++world->quiet[i];
+}
+
+static void work_wake(void *cfg, void *data)
+{
+  struct world_work *work = data;
+  struct world *world = cfg;
+  for (int i = work->start; i < work->end; ++i) {
+    if (!world->moved[i])
+      continue;
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k)
+      __atomic_store_n(&world->quiet[world->adj[k].j], 0, __ATOMIC_RELAXED);
+  }
+}
+
+size_t force_memory(int nitems, const struct options *options)
+{
+  long pagesize = sysconf(_SC_PAGESIZE);
+  int items_per_unit = work_grain(options);
+  size_t bufsize = sizeof(struct world_work)+items_per_unit*sizeof(struct pair);
+  size_t nbufs = (nitems+items_per_unit-1)/items_per_unit;
+  bufsize = (bufsize+pagesize-1)/pagesize*pagesize;
+  return nbufs*(bufsize+sizeof(struct barycenter)+sizeof(struct world_work *));
+}
+
 void work_map(void *cfg, void *data)
 {
   struct world_work *work = data;
@@ -68,10 +149,45 @@ void work_map(void *cfg, void *data)
   work->energy = 0;
   barycenter->x = barycenter->y = 0;
   struct pair *newpos = work->data;
+  work->weight = 0;
+  for (int i = work->start; i < work->end; ++i, ++newpos) {
+    if (world->vertices[i].weight <= 0)
+      continue;
+    if (vertex_frozen(world, i)) {
+      *newpos = world->vertices[i].pos;
+      world->moved[i] = 0;
+      ++work->weight;
+    } else {
+      work->energy += count_energy(world, &world->vertices[i].pos, newpos, i);
+      track_motion(world, i, newpos);
+    }
+    float weight = world->vertices[i].weight;
+    barycenter->x += newpos->x*weight;
+    barycenter->y += newpos->y*weight;
+  }
+}
+
+// For engines which leave the forces in world->force
+void work_apply(void *cfg, void *data)
+{
+  struct world_work *work = data;
+  struct world *world = cfg;
+  struct barycenter *barycenter = work->extra;
+  work->energy = 0;
+  barycenter->x = barycenter->y = 0;
+  struct pair *newpos = work->data;
+  work->weight = 0;
   for (int i = work->start; i < work->end; ++i, ++newpos) {
     if (world->vertices[i].weight <= 0)
       continue;
-    work->energy += count_energy(world, &world->vertices[i].pos, newpos, i);
+    if (vertex_frozen(world, i)) {
+      *newpos = world->vertices[i].pos;
+      world->moved[i] = 0;
+      ++work->weight;
+    } else {
+      work->energy += apply_force(world, &world->vertices[i].pos, world->force[i], newpos);
+      track_motion(world, i, newpos);
+    }
     float weight = world->vertices[i].weight;
     barycenter->x += newpos->x*weight;
     barycenter->y += newpos->y*weight;
@@ -103,14 +219,36 @@ double world_step(struct world *world)
   struct work_phase work_ops = {
     .work = &work_map
   };
-  give_work(world->pool, &work_ops, world, world->world_work);
+  world->sweep = world->step % FREEZE_SWEEP == 0;
+  switch (world->options->engine) {
+  case ENGINE_DIRECT:
+    gather_positions(world);
+    break;
+  case ENGINE_PAIRWISE:
+    pairwise_forces(world);
+    work_ops.work = &work_apply;
+    break;
+  case ENGINE_SAMPLED:
+    sampled_forces(world);
+    work_ops.work = &work_apply;
+    break;
+  case ENGINE_MESH:
+    mesh_forces(world);
+    work_ops.work = &work_apply;
+    break;
+  }
+  give_work(world->pool, &work_ops, world, world->local_work);
+  if (world->cluster)
+    cluster_exchange(world);
   struct world_work **workptr = world->world_work;
   struct barycenter barycenter = {0, 0};
+  world->nfrozen = 0;
   do {
     struct world_work *work = *workptr;
     barycenter.x += ((struct barycenter *)work->extra)->x;
     barycenter.y += ((struct barycenter *)work->extra)->y;
     energy += work->energy;
+    world->nfrozen += work->weight;
   } while (*(++workptr));
   barycenter.x *= world->world_weight_inv;
   barycenter.y *= world->world_weight_inv;
@@ -134,45 +272,146 @@ double world_step(struct world *world)
   give_work(world->pool, &work_ops, copy_data, world->world_work);
   free(copy_data);
 #endif
-  world->maxmove *= COOLING;
+  if (world->quiet) {
+    work_ops.work = &work_wake;
+    give_work(world->pool, &work_ops, world, world->world_work);
+  }
+  ++world->step;
+  world->maxmove *= world->cooling;
   world->repulsioncap *= REPULSION_CAP_CHANGE;
   return energy;
 }
 
-static double count_energy(struct world *world, struct pair *pos, struct pair *newpos, int i) {
-  double maxmove = world->maxmove;
-  double totalenergy = 0;
-  struct vertex *v1 = &world->vertices[i], *v2 = world->vertices;
-  struct edge *edge = world->edges+i*world->nitems;
-  struct pair force = {0};
-  for (int j = 0; j < world->nitems; ++j, ++v2, ++edge) {
-    double energy = 0;
-    if (i == j || world->vertices[j].weight < 0)
-      continue;
+/*
+  Radii and weights stay put during the force steps, so what the
+  inner loops need of them is tabled once.  The tables hold only the
+  live vertices, in world->live order, so dead ones cost nothing.  The
+  per edge tables follow world->adj but point into the live order;
+  edges to vertices that are not live are left out.
+*/
+struct target {
+  float weight, radius;
+  float reach;		// weight+radius
+};
+
+struct coefficients {
+  struct target *targets;	// index: live order
+  int *slot;			// index: vertex, its live order or -1
+  int *edge_start;		// index: vertex, its first entry in the edge tables
+  int *edge_target;		// index: edge entry, live order of j
+  float *edge_coef;		// index: edge entry, edge weight / weight of j
+};
 
-    double relax = v1->radius+v2->radius+RELAX_EXTRA;
-    double dist = hypot(pos->x-v2->pos.x, pos->y-v2->pos.y);
+struct source {
+  struct pair pos;
+  double relax;		// radius+RELAX_EXTRA, relax distance less the target's radius
+};
 
-    double repulsionenergy;
-    if (edge->weight > 0) {
-      energy = edge->weight / v2->weight * pow(dist - relax, 2) / (v2->weight + relax);
-      if (dist < relax)
-	energy = -energy;
+void init_coefficients(struct world *world)
+{
+  struct coefficients *coef = malloc(sizeof(struct coefficients));
+  size_t nadj = world->adj_start[world->nitems];
+  coef->targets = malloc(world->nlive*sizeof(struct target));
+  coef->slot = malloc(world->nitems*sizeof(int));
+  coef->edge_start = malloc((world->nitems+1)*sizeof(int));
+  coef->edge_target = malloc(nadj*sizeof(int));
+  coef->edge_coef = malloc(nadj*sizeof(float));
+  for (int i = 0; i < world->nitems; ++i)
+    coef->slot[i] = -1;
+  for (int t = 0; t < world->nlive; ++t) {
+    const struct vertex *v = &world->vertices[world->live[t]];
+    coef->targets[t].weight = v->weight;
+    coef->targets[t].radius = v->radius;
+    coef->targets[t].reach = v->weight+v->radius;
+    coef->slot[world->live[t]] = t;
+  }
+  int nedges = 0;
+  for (int i = 0; i < world->nitems; ++i) {
+    coef->edge_start[i] = nedges;
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      int j = world->adj[k].j;
+      if (coef->slot[j] < 0)
+	continue;
+      coef->edge_target[nedges] = coef->slot[j];
+      coef->edge_coef[nedges] = world->adj[k].weight/world->vertices[j].weight;
+      ++nedges;
     }
+  }
+  coef->edge_start[world->nitems] = nedges;
+  world->coef = coef;
+  world->live_pos = malloc(world->nlive*sizeof(struct pair));
+}
+
+size_t coefficients_memory(int nitems, size_t nadj)
+{
+  return nitems*(sizeof(struct target)+2*sizeof(int)+sizeof(struct pair))+nadj*(sizeof(int)+sizeof(float));
+}
+
+static void gather_positions(struct world *world)
+{
+  for (int t = 0; t < world->nlive; ++t)
+    world->live_pos[t] = world->vertices[world->live[t]].pos;
+}
 
-    repulsionenergy = pow(v2->weight+relax, 2)/dist;
-    double cap = world->repulsioncap*v2->weight;
-    if (repulsionenergy > cap)
-      repulsionenergy = cap;
-    repulsionenergy -= 0.01;
-    energy -= repulsionenergy;
-
-    double normX = (v2->pos.x-pos->x)/dist, normY = (v2->pos.y-pos->y)/dist;
-    energy /= v1->weight;
-    force.x += energy*normX;
-    force.y += energy*normY;
+/*
+  The inner loops of count_energy, one for the edges of a vertex and
+  one for the repulsion from every other live vertex.  Both come from
+  this one body; ATTRACT is a constant, so each compiles down to its
+  own arithmetic with no branch on edge presence.
+*/
+#define INTERACTION_LOOP(name, ATTRACT)					\
+  static void name(const struct world *world, const struct source *src, \
+		   int begin, int end, struct pair *force)		\
+  {									\
+    const struct coefficients *coef = world->coef;			\
+    const struct pair *pos = world->live_pos;				\
+    double repulsioncap = world->repulsioncap;				\
+    for (int k = begin; k < end; ++k) {					\
+      int t = ATTRACT ? coef->edge_target[k] : k;			\
+      const struct target *target = &coef->targets[t];			\
+      double dx = pos[t].x-src->pos.x, dy = pos[t].y-src->pos.y;	\
+      double dist = sqrt(dx*dx+dy*dy);					\
+      double relax = src->relax+target->radius;			\
+      double energy;							\
+      if (ATTRACT) {							\
+	double stretch = dist-relax;					\
+	energy = coef->edge_coef[k]*stretch*fabs(stretch)/(target->weight+relax); \
+      } else {								\
+	double reach = target->reach+src->relax;			\
+	double cap = repulsioncap*target->weight;			\
+	energy = reach*reach/dist;					\
+	if (energy > cap)						\
+	  energy = cap;							\
+	energy = 0.01-energy;						\
+      }									\
+      force->x += energy*dx/dist;					\
+      force->y += energy*dy/dist;					\
+    }									\
   }
 
+INTERACTION_LOOP(attraction_loop, 1)
+INTERACTION_LOOP(repulsion_loop, 0)
+
+static double count_energy(struct world *world, struct pair *pos, struct pair *newpos, int i) {
+  const struct vertex *v1 = &world->vertices[i];
+  struct source src = {
+    .pos = *pos,
+    .relax = v1->radius+RELAX_EXTRA
+  };
+  struct pair force = {0};
+  int self = world->coef->slot[i];
+  repulsion_loop(world, &src, 0, self, &force);
+  repulsion_loop(world, &src, self+1, world->nlive, &force);
+  attraction_loop(world, &src, world->coef->edge_start[i], world->coef->edge_start[i+1], &force);
+  force.x /= v1->weight;
+  force.y /= v1->weight;
+
+  return apply_force(world, pos, force, newpos);
+}
+
+// Moves by force, at most maxmove.  Returns the unclamped length.
+static double apply_force(struct world *world, struct pair *pos, struct pair force, struct pair *newpos)
+{
   double energy = hypot(force.x, force.y);
   if (energy > world->maxmove) {
     double scale = world->maxmove/energy;
@@ -25,7 +25,26 @@
 
 #include "world.h"
 
+#define COOLING 0.995
+struct barycenter {
+  long double x, y;
+};
+
+#define FREEZE_STEPS 5	// quiet steps before a vertex is frozen
+
+// Frozen vertices keep their place but still push and pull the others
+static inline int vertex_frozen(const struct world *world, int i)
+{
+  return world->quiet && !world->sweep && world->quiet[i] >= FREEZE_STEPS;
+}
+
+int work_grain(const struct options *);
 void init_force(struct world *);
+void init_freeze(struct world *);
+void init_coefficients(struct world *);
+size_t coefficients_memory(int, size_t);
+void free_force(struct world *);
+size_t force_memory(int, const struct options *);
 void *map_worker(void *);
 double world_step(struct world *);
 double sparsify_step(struct world *);
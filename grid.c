@@ -0,0 +1,169 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "world.h"
+#include "worker.h"
+#include "grid.h"
+
+#define GRID_BUCKETS_PER_UNIT 4096
+
+void init_grid(struct world *world)
+{
+  struct grid *grid = malloc(sizeof(struct grid));
+  unsigned nbuckets = 64;
+  while (nbuckets < 2*(unsigned)world->nitems)
+    nbuckets <<= 1;
+  grid->mask = nbuckets-1;
+  grid->bucket_start = malloc((nbuckets+1)*sizeof(int));
+  grid->fill = malloc(nbuckets*sizeof(int));
+  grid->items = malloc(world->nitems*sizeof(int));
+  grid->bucket_of = malloc(world->nitems*sizeof(unsigned));
+  int nwork = (nbuckets+GRID_BUCKETS_PER_UNIT-1)/GRID_BUCKETS_PER_UNIT;
+  grid->work = malloc((nwork+1)*sizeof(struct grid_work *));
+  for (int i = 0; i < nwork; ++i) {
+    grid->work[i] = malloc(sizeof(struct grid_work));
+    grid->work[i]->start = i*GRID_BUCKETS_PER_UNIT;
+    grid->work[i]->end = (i+1)*GRID_BUCKETS_PER_UNIT < (int)nbuckets ? (i+1)*GRID_BUCKETS_PER_UNIT : (int)nbuckets;
+  }
+  grid->work[nwork] = NULL;
+  world->grid = grid;
+}
+
+void free_grid(struct grid *grid)
+{
+  for (struct grid_work **work = grid->work; *work; ++work)
+    free(*work);
+  free(grid->work);
+  free(grid->bucket_start);
+  free(grid->fill);
+  free(grid->items);
+  free(grid->bucket_of);
+  free(grid);
+}
+
+size_t grid_memory(int nitems)
+{
+  size_t nbuckets = 64;
+  while (nbuckets < 2*(size_t)nitems)
+    nbuckets <<= 1;
+  return (2*nbuckets+1)*sizeof(int)+nitems*(sizeof(int)+sizeof(unsigned));
+}
+
+static void grid_count_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct grid *grid = world->grid;
+  for (int i = work->start; i < work->end; ++i) {
+    struct vertex *v = &world->vertices[i];
+    if (v->weight <= 0) {
+      grid->bucket_of[i] = GRID_NONE;
+      continue;
+    }
+    unsigned bucket = grid_hash(grid, grid_coord(grid, v->pos.x), grid_coord(grid, v->pos.y));
+    grid->bucket_of[i] = bucket;
+    __atomic_fetch_add(&grid->bucket_start[bucket+1], 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void grid_scatter_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct grid *grid = world->grid;
+  for (int i = work->start; i < work->end; ++i) {
+    unsigned bucket = grid->bucket_of[i];
+    if (bucket == GRID_NONE)
+      continue;
+    grid->items[__atomic_fetch_add(&grid->fill[bucket], 1, __ATOMIC_RELAXED)] = i;
+  }
+}
+
+// Scatter order depends on thread timing, sorting keeps users deterministic
+static void grid_sort_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct grid_work *work = data;
+  struct grid *grid = world->grid;
+  for (int b = work->start; b < work->end; ++b) {
+    int *items = grid->items;
+    for (int k = grid->bucket_start[b]+1; k < grid->bucket_start[b+1]; ++k) {
+      int item = items[k], l = k;
+      while (l > grid->bucket_start[b] && items[l-1] > item) {
+	items[l] = items[l-1];
+	--l;
+      }
+      items[l] = item;
+    }
+  }
+}
+
+// Rehash the live vertices into cells of the given size
+void grid_build(struct world *world, double cellsize)
+{
+  struct grid *grid = world->grid;
+  unsigned nbuckets = grid->mask+1;
+  struct work_phase work_ops = {
+    .work = &grid_count_work
+  };
+  grid->cellsize = cellsize;
+  grid->inv_cellsize = 1/cellsize;
+  memset(grid->bucket_start, 0, (nbuckets+1)*sizeof(int));
+  give_work(world->pool, &work_ops, world, world->world_work);
+  for (unsigned b = 0; b < nbuckets; ++b) {
+    grid->bucket_start[b+1] += grid->bucket_start[b];
+    grid->fill[b] = grid->bucket_start[b];
+  }
+  work_ops.work = &grid_scatter_work;
+  give_work(world->pool, &work_ops, world, world->world_work);
+  work_ops.work = &grid_sort_work;
+  give_work(world->pool, &work_ops, world, grid->work);
+}
+
+/*
+  Buckets of the 3x3 cells around a point, without duplicates.  With
+  cellsize at least the interaction distance these hold every vertex
+  that can interact with the point.
+*/
+int grid_neighbor_buckets(const struct grid *grid, const struct pair *pos, unsigned *buckets)
+{
+  int64_t cx = grid_coord(grid, pos->x), cy = grid_coord(grid, pos->y);
+  int n = 0;
+  for (int dx = -1; dx <= 1; ++dx) {
+    for (int dy = -1; dy <= 1; ++dy) {
+      unsigned bucket = grid_hash(grid, cx+dx, cy+dy);
+      int k;
+      if (grid->bucket_start[bucket] == grid->bucket_start[bucket+1])
+	continue;
+      for (k = 0; k < n && buckets[k] != bucket; ++k)
+	;
+      if (k == n)
+	buckets[n++] = bucket;
+    }
+  }
+  return n;
+}
@@ -0,0 +1,70 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _GRID_H
+#define _GRID_H
+
+#include <math.h>
+#include <stdint.h>
+#include "world.h"
+
+/*
+  Spatial hash of the live vertices.  The plane is cut into square
+  cells and each cell hashes to a bucket, so memory stays proportional
+  to the number of vertices however far the layout spreads.  Distinct
+  cells may share a bucket, users have to check distances anyway.
+*/
+
+struct grid_work {
+  int start, end;
+};
+
+struct grid {
+  double cellsize, inv_cellsize;
+  unsigned mask;		// number of buckets - 1
+  int *bucket_start;	// index: bucket, mask+2 entries
+  int *fill;
+  int *items;		// vertex indices, ascending within a bucket
+  unsigned *bucket_of;	// index: vertex
+  struct grid_work **work;	// bucket ranges
+};
+
+#define GRID_NONE (~0U)
+
+void init_grid(struct world *);
+void free_grid(struct grid *);
+size_t grid_memory(int);
+void grid_build(struct world *, double);
+int grid_neighbor_buckets(const struct grid *, const struct pair *, unsigned *);
+
+static inline unsigned grid_hash(const struct grid *grid, int64_t cx, int64_t cy)
+{
+  uint64_t h = (uint64_t)cx*0x9E3779B97F4A7C15ULL ^ (uint64_t)cy*0xC2B2AE3D27D4EB4FULL;
+  return (h ^ (h >> 29)) & grid->mask;
+}
+
+static inline int64_t grid_coord(const struct grid *grid, double v)
+{
+  return (int64_t)floor(v*grid->inv_cellsize);
+}
+
+#endif
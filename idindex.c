@@ -0,0 +1,78 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include "idindex.h"
+
+static unsigned index_size(int nitems)
+{
+  unsigned size = 16;
+  while (size < 2*(unsigned)nitems)
+    size <<= 1;
+  return size;
+}
+
+static unsigned id_hash(int64_t id)
+{
+  uint64_t h = (uint64_t)id;
+  h = (h ^ (h >> 33))*0xFF51AFD7ED558CCDULL;
+  h = (h ^ (h >> 33))*0xC4CEB9FE1A85EC53ULL;
+  return h ^ (h >> 33);
+}
+
+struct id_index *new_id_index(int nitems)
+{
+  struct id_index *index = malloc(sizeof(struct id_index));
+  unsigned size = index_size(nitems);
+  index->mask = size-1;
+  index->keys = malloc(size*sizeof(int64_t));
+  index->values = calloc(size, sizeof(int));
+  return index;
+}
+
+size_t id_index_memory(int nitems)
+{
+  return sizeof(struct id_index)+index_size(nitems)*(sizeof(int64_t)+sizeof(int));
+}
+
+// A later value for the same id replaces the earlier one
+void id_index_put(struct id_index *index, int64_t id, int value)
+{
+  unsigned slot = id_hash(id) & index->mask;
+  while (index->values[slot] && index->keys[slot] != id)
+    slot = (slot+1) & index->mask;
+  index->keys[slot] = id;
+  index->values[slot] = value;
+}
+
+int id_index_get(const struct id_index *index, int64_t id)
+{
+  unsigned slot = id_hash(id) & index->mask;
+  while (index->values[slot]) {
+    if (index->keys[slot] == id)
+      return index->values[slot];
+    slot = (slot+1) & index->mask;
+  }
+  return 0;
+}
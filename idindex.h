@@ -0,0 +1,46 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _IDINDEX_H
+#define _IDINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Item id to internal id lookup.  Open addressing with linear probing,
+  sized by the number of items so that large or sparse ids cost
+  nothing extra.  Values are internal ids > 0, 0 means not found.
+*/
+
+struct id_index {
+  int64_t *keys;
+  int *values;
+  unsigned mask;
+};
+
+struct id_index *new_id_index(int);
+size_t id_index_memory(int);
+void id_index_put(struct id_index *, int64_t, int);
+int id_index_get(const struct id_index *, int64_t);
+
+#endif
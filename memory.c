@@ -0,0 +1,178 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "world.h"
+#include "force.h"
+#include "grid.h"
+#include "nlist.h"
+#include "pairwise.h"
+#include "sampled.h"
+#include "output.h"
+#include "idindex.h"
+#include "tiles.h"
+#include "mesh.h"
+#include "spectral.h"
+#include "prune.h"
+#include "memory.h"
+
+/*
+  Estimates what a run will allocate before init_world commits to it
+  and picks the edge storage to use.  The dense edge matrix grows with
+  the square of the item count, so it's the part that gets dropped:
+  without it, edges are only kept in the adjacency lists and picks are
+  gathered as a sorted pair list instead.  Runs that wouldn't fit even
+  then stop here with a report, rather than being OOM killed later.
+*/
+
+struct estimate {
+  const char *name;
+  size_t bytes;
+};
+
+// Accepts a byte count with an optional K, M or G suffix, 0 for anything else
+size_t parse_size(const char *arg)
+{
+  char *end;
+  // strtod would also take blanks, a sign, inf and nan
+  if (!isdigit((unsigned char)*arg) && *arg != '.')
+    return 0;
+  double value = strtod(arg, &end);
+  switch (*end) {
+  case 'g': case 'G':
+    value *= 1024;
+    /* fall through */
+  case 'm': case 'M':
+    value *= 1024;
+    /* fall through */
+  case 'k': case 'K':
+    value *= 1024;
+    ++end;
+  }
+  if (*end || value < 1 || value >= (double)SIZE_MAX)
+    return 0;
+  return value;
+}
+
+static void print_size(size_t bytes)
+{
+  const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  double value = bytes;
+  int unit = 0;
+  while (value >= 1024 && unit < 4) {
+    value /= 1024;
+    ++unit;
+  }
+  fprintf(stderr, "%8.1f %s", value, units[unit]);
+}
+
+static size_t report(const struct estimate *parts, int nparts, int print)
+{
+  size_t total = 0;
+  for (int i = 0; i < nparts; ++i) {
+    total += parts[i].bytes;
+    if (print && parts[i].bytes) {
+      fprintf(stderr, "  %-22s", parts[i].name);
+      print_size(parts[i].bytes);
+      fputc('\n', stderr);
+    }
+  }
+  if (print) {
+    fprintf(stderr, "  %-22s", "total");
+    print_size(total);
+    fputc('\n', stderr);
+  }
+  return total;
+}
+
+/*
+  npairs is the number of item pairs the picks mention, duplicates
+  included, which bounds the number of distinct edges.
+*/
+void plan_memory(struct world *world, size_t npairs)
+{
+  size_t n = world->nitems, budget = world->options->memory_budget;
+  size_t edges = npairs < n*(n-1)/2 ? npairs : n*(n-1)/2;
+  size_t engine = world->options->engine == ENGINE_PAIRWISE ? pairwise_memory(world->nitems)
+    : world->options->engine == ENGINE_SAMPLED ? sampled_memory(world->nitems)
+    : world->options->engine == ENGINE_MESH ? mesh_memory(world->nitems, world->options->mesh) : 0;
+  // Each ensemble candidate has its own layout state
+  size_t candidate = n*sizeof(struct vertex)+force_memory(world->nitems, world->options)
+    +grid_memory(world->nitems)+nlist_memory(world->nitems)+engine
+    +(world->options->freeze > 0 ? 2*n : 0);
+  struct estimate parts[] = {
+    {"vertices", n*sizeof(struct vertex)},
+    {"id maps", (n+1)*sizeof(int64_t)+id_index_memory(world->nitems)},
+    {"adjacency", (n+1)*sizeof(int)+2*edges*sizeof(struct adjacency)+n*sizeof(int)},
+    {"work units", force_memory(world->nitems, world->options)},
+    {"coefficients", coefficients_memory(world->nitems, 2*edges)},
+    {"spatial grid", grid_memory(world->nitems)},
+    {"neighbour lists", nlist_memory(world->nitems)},
+    {"force engine", engine},
+    {"ensemble", world->options->ensemble > 1 ? world->options->ensemble*candidate : 0},
+    {"edge pruning", world->options->prune_weight > 0 || world->options->prune_top > 0 ||
+     world->options->prune_alpha > 0 ? prune_memory(world->nitems, edges) : 0},
+    {"spectral start", world->options->spectral ? spectral_memory(world->nitems) : 0},
+    {"freezing", world->options->freeze > 0 ? 2*n : 0},
+    {"sparsify", 2*n},
+    {"output buffers", output_memory(world->nitems)},
+    {"tiles", world->options->tiles ? tiles_memory(world->nitems, world->options->tile_levels) : 0},
+    {"edge matrix", n*n*sizeof(struct edge)},
+    {"pick pair list", 0}
+  };
+  const int nparts = sizeof(parts)/sizeof(parts[0]);
+  struct estimate *matrix = &parts[nparts-2], *pairlist = &parts[nparts-1];
+
+  // The sampled and mesh engines only ever walk the adjacency lists, and
+  // with --cache the matrix would be filled before a hit could skip it
+  world->dense_edges = world->options->engine != ENGINE_SAMPLED && world->options->engine != ENGINE_MESH
+    && !world->options->cache;
+  if (!budget && world->dense_edges)
+    return;
+  if (world->dense_edges && report(parts, nparts, 0) > budget)
+    world->dense_edges = 0;
+  if (!world->dense_edges) {
+    matrix->bytes = 0;
+    pairlist->bytes = npairs*sizeof(unsigned long long);
+  }
+  if (!budget)
+    return;
+
+  size_t total = report(parts, nparts, 0);
+  if (total > budget || world->options->verbose) {
+    fprintf(stderr, "forcelayout: memory plan for %d items, %zu edges at most, %s edge storage\n",
+	    world->nitems, edges, world->dense_edges ? "dense" : "sparse");
+    report(parts, nparts, 1);
+    fprintf(stderr, "  %-22s", "budget");
+    print_size(budget);
+    fputc('\n', stderr);
+  }
+  if (total > budget) {
+    fprintf(stderr, "forcelayout: layout doesn't fit in the memory budget\n");
+    exit(1);
+  }
+}
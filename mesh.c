@@ -0,0 +1,416 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include "world.h"
+#include "worker.h"
+#include "nlist.h"
+#include "force.h"
+#include "mesh.h"
+
+/*
+  Particle-mesh repulsion.  Repulsion from j on i is
+  (a_j+c_i)^2 r/|r|^2 - 0.01 r/|r| with a_j = weight+radius of j,
+  c_i = radius of i + RELAX_EXTRA and r from j to i, so it is the sum
+  of three fields of the kernel r/|r|^2 with charges a_j^2, a_j and 1,
+  and one of r/|r| with charge 1, each scaled by a power of c_i.
+
+  Both kernels are split by a Gaussian of MESH_SIGMA cells.  The smooth
+  long range parts come from the mesh: charges are deposited onto the
+  cells with bilinear weights, convolved by FFT with zero padding so
+  nothing wraps around, and interpolated back the same way.  The short
+  range rest is taken exactly from the Verlet lists, together with the
+  repulsion cap, for pairs within MESH_NEAR sigmas where the Gaussian
+  has died off.
+
+  The cell size is a power of two big enough to cover the live
+  vertices with g cells a side, so in cell units the kernels never
+  change and their transforms are done once.  A step costs
+  O(N + G log G) with G = 4g^2 plus the near pairs.  Everything but
+  the deposit runs on the pool, and the deposit is serial, so the
+  result doesn't depend on the thread count.
+*/
+
+#define MESH_SIGMA 1.0	// in cells
+#define MESH_NEAR 3.0	// in sigmas
+#define MESH_SKIN 0.5	// in near cutoffs
+#define FFT_LINES_PER_UNIT 8
+
+enum {
+  FIELD_A2,		// charge a^2, kernel r/|r|^2
+  FIELD_A,		// charge a
+  FIELD_ONE,		// charge 1
+  FIELD_CONST,		// charge 1, kernel r/|r|
+  NFIELDS
+};
+
+struct fft_work {
+  int start, end;	// rows or columns
+  double complex *columns;	// the unit's columns side by side, gathered together
+};
+
+struct mesh {
+  int g, p, logp;	// cells a side, padded transform size
+  double h, ox, oy;	// cell size, lower corner
+  int *bitrev;
+  double complex *twiddle;
+  double complex *green, *green_const;	// transformed kernels
+  double complex *field[NFIELDS];
+  struct fft_work **work;
+  // Set for each pass
+  double complex **data;
+  int ndata, inverse, columns;
+};
+
+static void fft(const struct mesh *mesh, double complex *x, int inverse)
+{
+  int n = mesh->p;
+  for (int i = 0; i < n; ++i) {
+    int j = mesh->bitrev[i];
+    if (i < j) {
+      double complex t = x[i];
+      x[i] = x[j];
+      x[j] = t;
+    }
+  }
+  for (int len = 2, step = n/2; len <= n; len <<= 1, step >>= 1) {
+    int half = len/2;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < half; ++k) {
+	double complex w = inverse ? conj(mesh->twiddle[k*step]) : mesh->twiddle[k*step];
+	double complex u = x[i+k], v = x[i+k+half]*w;
+	x[i+k] = u+v;
+	x[i+k+half] = u-v;
+      }
+    }
+  }
+}
+
+static void fft_work(void *cfg, void *data)
+{
+  struct mesh *mesh = cfg;
+  struct fft_work *work = data;
+  int p = mesh->p, n = work->end-work->start;
+  for (int d = 0; d < mesh->ndata; ++d) {
+    double complex *grid = mesh->data[d];
+    if (!mesh->columns) {
+      for (int l = work->start; l < work->end; ++l)
+	fft(mesh, grid+(size_t)l*p, mesh->inverse);
+      continue;
+    }
+    // Stepping down the rows once for all the columns keeps to whole cache lines
+    for (int y = 0; y < p; ++y)
+      for (int l = 0; l < n; ++l)
+	work->columns[(size_t)l*p+y] = grid[(size_t)y*p+work->start+l];
+    for (int l = 0; l < n; ++l)
+      fft(mesh, work->columns+(size_t)l*p, mesh->inverse);
+    for (int y = 0; y < p; ++y)
+      for (int l = 0; l < n; ++l)
+	grid[(size_t)y*p+work->start+l] = work->columns[(size_t)l*p+y];
+  }
+}
+
+/*
+  2D transform of the grids.  Only the first g rows hold charges going
+  forward and only the first g rows are read after going back, so the
+  row transforms of the rest are skipped.
+*/
+static void fft2(struct world *world, double complex **data, int ndata, int inverse)
+{
+  struct mesh *mesh = world->mesh;
+  struct work_phase ops = {
+    .work = &fft_work
+  };
+  int nunits = (mesh->p+FFT_LINES_PER_UNIT-1)/FFT_LINES_PER_UNIT;
+  int rows = (mesh->g+FFT_LINES_PER_UNIT-1)/FFT_LINES_PER_UNIT;
+  mesh->data = data;
+  mesh->ndata = ndata;
+  mesh->inverse = inverse;
+  for (int pass = 0; pass < 2; ++pass) {
+    // Row passes cut the unit list short for a while
+    int last = (mesh->columns = inverse ? pass == 0 : pass == 1) ? nunits : rows;
+    struct fft_work *cut = mesh->work[last];
+    mesh->work[last] = NULL;
+    give_work(world->pool, &ops, mesh, mesh->work);
+    mesh->work[last] = cut;
+  }
+}
+
+// Long range part of the kernels at offset m cells
+static double complex green(int mx, int my, int constant)
+{
+  double r2 = (double)mx*mx+(double)my*my;
+  if (r2 == 0)
+    return 0;
+  double smooth = 1-exp(-r2/(2*MESH_SIGMA*MESH_SIGMA));
+  double scale = constant ? smooth/sqrt(r2) : smooth/r2;
+  return mx*scale+I*my*scale;
+}
+
+static int mesh_size(const struct world *world)
+{
+  int g = 16;
+  if (world->options->mesh > 0)
+    return world->options->mesh;
+  // About a cell per live vertex
+  while (g < 2048 && (double)g*g < world->nlive)
+    g <<= 1;
+  return g;
+}
+
+void init_mesh(struct world *world)
+{
+  struct mesh *mesh = malloc(sizeof(struct mesh));
+  int g = mesh_size(world), p = 2*g;
+  size_t cells = (size_t)p*p;
+  mesh->g = g;
+  mesh->p = p;
+  mesh->h = 0;
+  for (mesh->logp = 0; 1 << mesh->logp < p; ++mesh->logp);
+  mesh->bitrev = malloc(p*sizeof(int));
+  for (int i = 0; i < p; ++i) {
+    int r = 0;
+    for (int b = 0; b < mesh->logp; ++b)
+      r |= ((i >> b) & 1) << (mesh->logp-1-b);
+    mesh->bitrev[i] = r;
+  }
+  mesh->twiddle = malloc(p/2*sizeof(double complex));
+  for (int k = 0; k < p/2; ++k)
+    mesh->twiddle[k] = cexp(-2*M_PI*I*k/p);
+  for (int f = 0; f < NFIELDS; ++f)
+    mesh->field[f] = malloc(cells*sizeof(double complex));
+  mesh->green = malloc(cells*sizeof(double complex));
+  mesh->green_const = malloc(cells*sizeof(double complex));
+  int nunits = (p+FFT_LINES_PER_UNIT-1)/FFT_LINES_PER_UNIT;
+  mesh->work = malloc((nunits+1)*sizeof(struct fft_work *));
+  for (int u = 0; u < nunits; ++u) {
+    mesh->work[u] = malloc(sizeof(struct fft_work));
+    mesh->work[u]->start = u*FFT_LINES_PER_UNIT;
+    mesh->work[u]->end = (u+1)*FFT_LINES_PER_UNIT < p ? (u+1)*FFT_LINES_PER_UNIT : p;
+    mesh->work[u]->columns = malloc((size_t)FFT_LINES_PER_UNIT*p*sizeof(double complex));
+  }
+  mesh->work[nunits] = NULL;
+  world->mesh = mesh;
+
+  // Offsets past p/2 wrap around to negative ones
+  for (int y = 0; y < p; ++y) {
+    for (int x = 0; x < p; ++x) {
+      int mx = x < p/2 ? x : x-p, my = y < p/2 ? y : y-p;
+      mesh->green[(size_t)y*p+x] = green(mx, my, 0);
+      mesh->green_const[(size_t)y*p+x] = green(mx, my, 1);
+    }
+  }
+  // The kernels go forward on all rows, not just the first g
+  mesh->g = p;
+  double complex *kernels[] = {mesh->green, mesh->green_const};
+  fft2(world, kernels, 2, 0);
+  mesh->g = g;
+  world->force = malloc(world->nitems*sizeof(struct pair));
+}
+
+void free_mesh(struct world *world)
+{
+  struct mesh *mesh = world->mesh;
+  for (struct fft_work **work = mesh->work; *work; ++work) {
+    free((*work)->columns);
+    free(*work);
+  }
+  free(mesh->work);
+  for (int f = 0; f < NFIELDS; ++f)
+    free(mesh->field[f]);
+  free(mesh->green);
+  free(mesh->green_const);
+  free(mesh->twiddle);
+  free(mesh->bitrev);
+  free(mesh);
+  free(world->force);
+  world->mesh = NULL;
+  world->force = NULL;
+}
+
+size_t mesh_memory(int nitems, int g)
+{
+  size_t p = 2*(size_t)g;
+  if (g <= 0) {
+    for (g = 16; g < 2048 && (double)g*g < nitems; g <<= 1);
+    p = 2*(size_t)g;
+  }
+  return (NFIELDS+2)*p*p*sizeof(double complex)+p*p*sizeof(double complex)
+    +nitems*sizeof(struct pair);
+}
+
+// Picks the cell size and corner so the live vertices fit in g cells
+static void place_mesh(struct world *world)
+{
+  struct mesh *mesh = world->mesh;
+  double minx = 0, miny = 0, maxx = 0, maxy = 0;
+  for (int l = 0; l < world->nlive; ++l) {
+    const struct pair *pos = &world->vertices[world->live[l]].pos;
+    if (!l || pos->x < minx)
+      minx = pos->x;
+    if (!l || pos->y < miny)
+      miny = pos->y;
+    if (!l || pos->x > maxx)
+      maxx = pos->x;
+    if (!l || pos->y > maxy)
+      maxy = pos->y;
+  }
+  double extent = fmax(maxx-minx, maxy-miny);
+  // Rounding the corner down takes up to a cell, the deposit one more
+  double h = exp2(ceil(log2(fmax(extent, 1e-9)/(mesh->g-3))));
+  mesh->h = h;
+  mesh->ox = floor(minx/h)*h;
+  mesh->oy = floor(miny/h)*h;
+}
+
+static void cic(const struct mesh *mesh, const struct pair *pos, size_t *cell, double *w)
+{
+  double cx = (pos->x-mesh->ox)/mesh->h, cy = (pos->y-mesh->oy)/mesh->h;
+  int ix = (int)cx, iy = (int)cy;
+  double fx = cx-ix, fy = cy-iy;
+  *cell = (size_t)iy*mesh->p+ix;
+  w[0] = (1-fx)*(1-fy);
+  w[1] = fx*(1-fy);
+  w[2] = (1-fx)*fy;
+  w[3] = fx*fy;
+}
+
+static void deposit(struct world *world)
+{
+  struct mesh *mesh = world->mesh;
+  size_t p = mesh->p, cells = p*p;
+  for (int f = 0; f < FIELD_CONST; ++f)
+    memset(mesh->field[f], 0, cells*sizeof(double complex));
+  for (int l = 0; l < world->nlive; ++l) {
+    const struct vertex *v = &world->vertices[world->live[l]];
+    double a = v->weight+v->radius, w[4];
+    size_t cell, offsets[4] = {0, 1, p, p+1};
+    cic(mesh, &v->pos, &cell, w);
+    for (int k = 0; k < 4; ++k) {
+      mesh->field[FIELD_A2][cell+offsets[k]] += a*a*w[k];
+      mesh->field[FIELD_A][cell+offsets[k]] += a*w[k];
+      mesh->field[FIELD_ONE][cell+offsets[k]] += w[k];
+    }
+  }
+}
+
+static void multiply_work(void *cfg, void *data)
+{
+  struct mesh *mesh = cfg;
+  struct fft_work *work = data;
+  size_t p = mesh->p;
+  double scale = 1.0/((double)p*p);
+  for (size_t c = work->start*p; c < work->end*p; ++c) {
+    double complex one = mesh->field[FIELD_ONE][c];
+    mesh->field[FIELD_A2][c] *= mesh->green[c]*scale;
+    mesh->field[FIELD_A][c] *= mesh->green[c]*scale;
+    mesh->field[FIELD_ONE][c] = one*mesh->green[c]*scale;
+    mesh->field[FIELD_CONST][c] = one*mesh->green_const[c]*scale;
+  }
+}
+
+static void mesh_vertex_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  const struct mesh *mesh = world->mesh;
+  const struct nlist *nlist = world->nlist;
+  double sigma = MESH_SIGMA*mesh->h, cutoff = nlist->cutoff;
+  size_t p = mesh->p, offsets[4] = {0, 1, p, p+1};
+  for (int i = work->start; i < work->end; ++i) {
+    const struct vertex *v1 = &world->vertices[i];
+    if (v1->weight <= 0 || vertex_frozen(world, i))
+      continue;
+    double c = v1->radius+RELAX_EXTRA;
+    struct pair force = {0};
+
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      const struct vertex *v2 = &world->vertices[world->adj[k].j];
+      double dx = v2->pos.x-v1->pos.x, dy = v2->pos.y-v1->pos.y;
+      double relax = v1->radius+v2->radius+RELAX_EXTRA;
+      double dist = sqrt(dx*dx+dy*dy);
+      double energy = world->adj[k].weight / v2->weight * (dist-relax)*(dist-relax) / (v2->weight + relax);
+      if (dist < relax)
+	energy = -energy;
+      force.x += energy*dx/dist;
+      force.y += energy*dy/dist;
+    }
+
+    // Long range, from the mesh
+    size_t cell;
+    double w[4];
+    double complex e = 0, e_const = 0;
+    cic(mesh, &v1->pos, &cell, w);
+    for (int k = 0; k < 4; ++k) {
+      size_t at = cell+offsets[k];
+      e += w[k]*(mesh->field[FIELD_A2][at]+2*c*mesh->field[FIELD_A][at]+c*c*mesh->field[FIELD_ONE][at]);
+      e_const += w[k]*mesh->field[FIELD_CONST][at];
+    }
+    e = e/mesh->h-0.01*e_const;
+    force.x += creal(e);
+    force.y += cimag(e);
+
+    // Short range and the cap, exactly
+    for (int k = nlist->start[i]; k < nlist->start[i+1]; ++k) {
+      const struct vertex *v2 = &world->vertices[nlist->items[k]];
+      double dx = v1->pos.x-v2->pos.x, dy = v1->pos.y-v2->pos.y;
+      double dist2 = dx*dx+dy*dy;
+      if (dist2 >= cutoff*cutoff)
+	continue;
+      double dist = sqrt(dist2);
+      double reach = v2->weight+v2->radius+c;
+      double full = reach*reach/dist, cap = world->repulsioncap*v2->weight;
+      double gauss = exp(-dist2/(2*sigma*sigma));
+      double energy = (full > cap ? cap : full)-full*(1-gauss)-0.01*gauss;
+      force.x += energy*dx/dist;
+      force.y += energy*dy/dist;
+    }
+
+    world->force[i].x = force.x/v1->weight;
+    world->force[i].y = force.y/v1->weight;
+  }
+}
+
+// Leaves the unclamped move of every vertex in world->force
+void mesh_forces(struct world *world)
+{
+  struct mesh *mesh = world->mesh;
+  struct work_phase ops = {
+    .work = &multiply_work
+  };
+  place_mesh(world);
+  deposit(world);
+  fft2(world, mesh->field, FIELD_CONST, 0);
+
+  give_work(world->pool, &ops, mesh, mesh->work);
+  fft2(world, mesh->field, NFIELDS, 1);
+
+  double cutoff = MESH_NEAR*MESH_SIGMA*mesh->h;
+  nlist_update(world, cutoff, MESH_SKIN*cutoff);
+  ops.work = &mesh_vertex_work;
+  give_work(world->pool, &ops, world, world->local_work);
+}
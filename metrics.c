@@ -0,0 +1,361 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include "world.h"
+#include "worker.h"
+#include "grid.h"
+#include "output.h"
+#include "metrics.h"
+
+/*
+  Layout quality, for checking that faster modes don't make worse
+  layouts.  --metrics FILE writes as JSON:
+
+  stress: normalized stress against hop distances from STRESS_SOURCES
+    evenly spaced sources, weights 1/d^2, at the best uniform scale
+  neighborhood: share of the NEIGHBORS nearest vertices in the layout
+    which are also among the heaviest graph neighbours, averaged over
+    NEIGHBOR_SAMPLES evenly spaced vertices
+  edge_length: distribution of edge lengths
+  overlap: pairs still closer than sparsify allows and by how much
+  displacement: distance to the same vertex in the -r reference
+
+  Every part runs on the pool and is summed up in a fixed order.
+*/
+
+#define METRIC_CHUNK 1024
+#define STRESS_SOURCES 64
+#define NEIGHBOR_SAMPLES 512
+#define NEIGHBORS 16
+#define METRIC_MAXLEN 2048
+
+struct vertex_metrics {
+  int start, end;
+  const struct vertex *reference;
+  float *lengths;	// index: adjacency entry, -1 unless j > i
+  long overlaps;
+  double overlap_sum, overlap_max;
+  long displaced;
+  double displacement_sum, displacement_sq, displacement_max;
+};
+
+struct stress_work {
+  int source;
+  long pairs;
+  double ll, ld, dd;	// sums of w*L^2, w*L*d and w*d^2
+};
+
+struct neighbor_work {
+  int i, k;
+  double preserved;
+};
+
+static double distance(const struct vertex *v1, const struct vertex *v2)
+{
+  return hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
+}
+
+static void vertex_metrics_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct vertex_metrics *work = data;
+  const struct grid *grid = world->grid;
+  work->overlaps = work->displaced = 0;
+  work->overlap_sum = work->overlap_max = 0;
+  work->displacement_sum = work->displacement_sq = work->displacement_max = 0;
+  for (int i = work->start; i < work->end; ++i) {
+    const struct vertex *v1 = &world->vertices[i];
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      int j = world->adj[k].j;
+      work->lengths[k] = j > i && v1->weight > 0 ? distance(v1, &world->vertices[j]) : -1;
+    }
+    if (v1->weight <= 0)
+      continue;
+
+    unsigned buckets[9];
+    int nbuckets = grid_neighbor_buckets(grid, &v1->pos, buckets);
+    for (int b = 0; b < nbuckets; ++b) {
+      for (int k = grid->bucket_start[buckets[b]]; k < grid->bucket_start[buckets[b]+1]; ++k) {
+	int j = grid->items[k];
+	const struct vertex *v2 = &world->vertices[j];
+	double depth = v1->radius+v2->radius+RELAX_EXTRA/2-distance(v1, v2);
+	if (j <= i || depth <= 0)
+	  continue;
+	++work->overlaps;
+	work->overlap_sum += depth;
+	if (depth > work->overlap_max)
+	  work->overlap_max = depth;
+      }
+    }
+
+    if (work->reference && work->reference[i].weight != 0) {
+      double d = distance(v1, &work->reference[i]);
+      ++work->displaced;
+      work->displacement_sum += d;
+      work->displacement_sq += d*d;
+      if (d > work->displacement_max)
+	work->displacement_max = d;
+    }
+  }
+}
+
+static void stress_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct stress_work *work = data;
+  int *hops = malloc(world->nitems*sizeof(int)), *queue = malloc(world->nitems*sizeof(int));
+  int head = 0, tail = 0;
+  const struct vertex *source = &world->vertices[work->source];
+  for (int i = 0; i < world->nitems; ++i)
+    hops[i] = -1;
+  hops[work->source] = 0;
+  queue[tail++] = work->source;
+  work->pairs = 0;
+  work->ll = work->ld = work->dd = 0;
+  while (head < tail) {
+    int i = queue[head++];
+    if (i != work->source) {
+      double d = hops[i], l = distance(source, &world->vertices[i]), w = 1/(d*d);
+      ++work->pairs;
+      work->ll += w*l*l;
+      work->ld += w*l*d;
+      work->dd += w*d*d;
+    }
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      int j = world->adj[k].j;
+      if (hops[j] < 0 && world->vertices[j].weight > 0) {
+	hops[j] = hops[i]+1;
+	queue[tail++] = j;
+      }
+    }
+  }
+  free(hops);
+  free(queue);
+}
+
+// Inserts into a list kept ascending by key, holding at most n
+static int insert_nearest(int *items, double *keys, int len, int n, int item, double key)
+{
+  if (len == n && key >= keys[n-1])
+    return len;
+  int k = len < n ? len++ : n-1;
+  for (; k > 0 && keys[k-1] > key; --k) {
+    items[k] = items[k-1];
+    keys[k] = keys[k-1];
+  }
+  items[k] = item;
+  keys[k] = key;
+  return len;
+}
+
+static void neighbor_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct neighbor_work *work = data;
+  int graph[NEIGHBORS], layout[NEIGHBORS], ngraph = 0, nlayout = 0;
+  double graph_keys[NEIGHBORS], layout_keys[NEIGHBORS];
+  const struct vertex *v1 = &world->vertices[work->i];
+  for (int k = world->adj_start[work->i]; k < world->adj_start[work->i+1]; ++k) {
+    int j = world->adj[k].j;
+    if (world->vertices[j].weight > 0)
+      ngraph = insert_nearest(graph, graph_keys, ngraph, NEIGHBORS, j, -world->adj[k].weight);
+  }
+  for (int l = 0; l < world->nlive; ++l) {
+    int j = world->live[l];
+    if (j != work->i)
+      nlayout = insert_nearest(layout, layout_keys, nlayout, ngraph, j, distance(v1, &world->vertices[j]));
+  }
+  int common = 0;
+  for (int a = 0; a < nlayout; ++a) {
+    for (int b = 0; b < ngraph; ++b)
+      common += layout[a] == graph[b];
+  }
+  work->k = ngraph;
+  work->preserved = ngraph ? (double)common/ngraph : 0;
+}
+
+static int float_comparator(const void *a, const void *b)
+{
+  float f1 = *(const float *)a, f2 = *(const float *)b;
+  return f1 < f2 ? -1 : f1 > f2;
+}
+
+static char *put_field(char *p, const char *name, double value)
+{
+  p = put_string(p, name);
+  return put_real(p, value, 0);
+}
+
+void write_metrics(struct world *world, const struct vertex *reference, int aligned, const char *path)
+{
+  struct work_phase ops = {
+    .work = &vertex_metrics_work
+  };
+  size_t nadj = world->adj_start[world->nitems];
+
+  // Per vertex: edge lengths, overlaps and displacement
+  int nchunks = (world->nitems+METRIC_CHUNK-1)/METRIC_CHUNK;
+  struct vertex_metrics *chunks = malloc(nchunks*sizeof(struct vertex_metrics));
+  void **work = malloc((nchunks+1)*sizeof(void *));
+  float *lengths = malloc(nadj*sizeof(float));
+  for (int c = 0; c < nchunks; ++c) {
+    chunks[c].start = c*METRIC_CHUNK;
+    chunks[c].end = (c+1)*METRIC_CHUNK < world->nitems ? (c+1)*METRIC_CHUNK : world->nitems;
+    chunks[c].reference = reference;
+    chunks[c].lengths = lengths;
+    work[c] = &chunks[c];
+  }
+  work[nchunks] = NULL;
+  grid_build(world, 2*world->maxradius+RELAX_EXTRA);
+  give_work(world->pool, &ops, world, work);
+  struct vertex_metrics total = {0};
+  for (int c = 0; c < nchunks; ++c) {
+    total.overlaps += chunks[c].overlaps;
+    total.overlap_sum += chunks[c].overlap_sum;
+    if (chunks[c].overlap_max > total.overlap_max)
+      total.overlap_max = chunks[c].overlap_max;
+    total.displaced += chunks[c].displaced;
+    total.displacement_sum += chunks[c].displacement_sum;
+    total.displacement_sq += chunks[c].displacement_sq;
+    if (chunks[c].displacement_max > total.displacement_max)
+      total.displacement_max = chunks[c].displacement_max;
+  }
+  size_t nedges = 0;
+  double length_sum = 0, length_sq = 0;
+  for (size_t k = 0; k < nadj; ++k) {
+    if (lengths[k] < 0)
+      continue;
+    length_sum += lengths[k];
+    length_sq += (double)lengths[k]*lengths[k];
+    lengths[nedges++] = lengths[k];
+  }
+  qsort(lengths, nedges, sizeof(float), float_comparator);
+
+  // Stress from evenly spaced sources
+  int nsources = world->nlive < STRESS_SOURCES ? world->nlive : STRESS_SOURCES;
+  struct stress_work *sources = malloc(nsources*sizeof(struct stress_work));
+  work = realloc(work, (nsources > NEIGHBOR_SAMPLES ? nsources+1 : NEIGHBOR_SAMPLES+1)*sizeof(void *));
+  for (int s = 0; s < nsources; ++s) {
+    sources[s].source = world->live[(long)s*world->nlive/nsources];
+    work[s] = &sources[s];
+  }
+  work[nsources] = NULL;
+  ops.work = &stress_work;
+  if (nsources)
+    give_work(world->pool, &ops, world, work);
+  double ll = 0, ld = 0, dd = 0;
+  long pairs = 0;
+  for (int s = 0; s < nsources; ++s) {
+    ll += sources[s].ll;
+    ld += sources[s].ld;
+    dd += sources[s].dd;
+    pairs += sources[s].pairs;
+  }
+
+  // Neighbourhoods of evenly spaced vertices
+  int nsamples = world->nlive < NEIGHBOR_SAMPLES ? world->nlive : NEIGHBOR_SAMPLES;
+  struct neighbor_work *samples = malloc(nsamples*sizeof(struct neighbor_work));
+  for (int s = 0; s < nsamples; ++s) {
+    samples[s].i = world->live[(long)s*world->nlive/nsamples];
+    work[s] = &samples[s];
+  }
+  work[nsamples] = NULL;
+  ops.work = &neighbor_work;
+  if (nsamples)
+    give_work(world->pool, &ops, world, work);
+  double preserved = 0;
+  int counted = 0;
+  for (int s = 0; s < nsamples; ++s) {
+    if (samples[s].k) {
+      preserved += samples[s].preserved;
+      ++counted;
+    }
+  }
+
+  char *buf = malloc(METRIC_MAXLEN), *p = buf;
+  double mean = nedges ? length_sum/nedges : 0;
+  p = put_string(p, "{\n  \"vertices\": ");
+  p = put_int(p, world->nlive);
+  p = put_string(p, ",\n  \"edges\": ");
+  p = put_int(p, nedges);
+  p = put_field(p, ",\n  \"stress\": {\n    \"value\": ", ll > 0 && dd > 0 ? 1-ld*ld/(dd*ll) : 0);
+  p = put_field(p, ",\n    \"scale\": ", dd > 0 ? ld/dd : 0);
+  p = put_string(p, ",\n    \"sources\": ");
+  p = put_int(p, nsources);
+  p = put_string(p, ",\n    \"pairs\": ");
+  p = put_int(p, pairs);
+  p = put_field(p, "\n  },\n  \"neighborhood\": {\n    \"preservation\": ", counted ? preserved/counted : 0);
+  p = put_string(p, ",\n    \"samples\": ");
+  p = put_int(p, counted);
+  p = put_field(p, "\n  },\n  \"edge_length\": {\n    \"min\": ", nedges ? lengths[0] : 0);
+  p = put_field(p, ",\n    \"p10\": ", nedges ? lengths[nedges/10] : 0);
+  p = put_field(p, ",\n    \"median\": ", nedges ? lengths[nedges/2] : 0);
+  p = put_field(p, ",\n    \"p90\": ", nedges ? lengths[nedges*9/10] : 0);
+  p = put_field(p, ",\n    \"max\": ", nedges ? lengths[nedges-1] : 0);
+  p = put_field(p, ",\n    \"mean\": ", mean);
+  p = put_field(p, ",\n    \"stddev\": ", nedges ? sqrt(fmax(length_sq/nedges-mean*mean, 0)) : 0);
+  p = put_string(p, "\n  },\n  \"overlap\": {\n    \"pairs\": ");
+  p = put_int(p, total.overlaps);
+  p = put_field(p, ",\n    \"total\": ", total.overlap_sum);
+  p = put_field(p, ",\n    \"max\": ", total.overlap_max);
+  p = put_string(p, "\n  },\n  \"displacement\": ");
+  if (reference) {
+    double n = total.displaced ? total.displaced : 1;
+    p = put_string(p, "{\n    \"vertices\": ");
+    p = put_int(p, total.displaced);
+    p = put_field(p, ",\n    \"mean\": ", total.displacement_sum/n);
+    p = put_field(p, ",\n    \"rms\": ", sqrt(total.displacement_sq/n));
+    p = put_field(p, ",\n    \"max\": ", total.displacement_max);
+    p = put_string(p, aligned ? ",\n    \"aligned\": true\n  }" : ",\n    \"aligned\": false\n  }");
+  } else {
+    p = put_string(p, "null");
+  }
+  p = put_string(p, "\n}\n");
+
+  struct iovec iov = {.iov_base = buf, .iov_len = p-buf};
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  write_all(fd, &iov, 1, path);
+  if (close(fd) < 0) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  free(buf);
+  free(samples);
+  free(sources);
+  free(lengths);
+  free(work);
+  free(chunks);
+}
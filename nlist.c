@@ -0,0 +1,179 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <math.h>
+#include "world.h"
+#include "worker.h"
+#include "grid.h"
+#include "nlist.h"
+
+void init_nlist(struct world *world)
+{
+  struct nlist *nlist = malloc(sizeof(struct nlist));
+  nlist->start = malloc((world->nitems+1)*sizeof(int));
+  nlist->capacity = 0;
+  nlist->items = NULL;
+  nlist->built_pos = malloc(world->nitems*sizeof(struct pair));
+  nlist->valid = 0;
+  nlist->rebuilds = 0;
+  world->nlist = nlist;
+}
+
+void free_nlist(struct nlist *nlist)
+{
+  free(nlist->start);
+  free(nlist->items);
+  free(nlist->built_pos);
+  free(nlist);
+}
+
+// Typical list length, for memory estimates
+#define NLIST_GUESS 16
+
+size_t nlist_memory(int nitems)
+{
+  return (nitems+1)*sizeof(int)+nitems*(sizeof(struct pair)+NLIST_GUESS*sizeof(int));
+}
+
+// Runs body for each live j within range of i, in a deterministic order
+#define FOREACH_CANDIDATE(world, i, range, body)			\
+  do {									\
+    struct grid *grid_ = (world)->grid;					\
+    unsigned buckets_[9];						\
+    const struct vertex *v1_ = &(world)->vertices[i];			\
+    int nbuckets_ = grid_neighbor_buckets(grid_, &v1_->pos, buckets_); \
+    double range2_ = (range)*(range);					\
+    for (int b_ = 0; b_ < nbuckets_; ++b_) {				\
+      const int *ptr_ = grid_->items+grid_->bucket_start[buckets_[b_]]; \
+      const int *end_ = grid_->items+grid_->bucket_start[buckets_[b_]+1]; \
+      for (; ptr_ < end_; ++ptr_) {					\
+	int j = *ptr_;							\
+	const struct vertex *v2_ = &(world)->vertices[j];		\
+	if (j == (i))							\
+	  continue;							\
+	double dx_ = v1_->pos.x-v2_->pos.x, dy_ = v1_->pos.y-v2_->pos.y; \
+	if (dx_*dx_+dy_*dy_ >= range2_)					\
+	  continue;							\
+	body;								\
+      }									\
+    }									\
+  } while (0)
+
+static void nlist_count_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct nlist *nlist = world->nlist;
+  double range = nlist->cutoff+nlist->skin;
+  for (int i = work->start; i < work->end; ++i) {
+    int count = 0;
+    if (world->vertices[i].weight > 0)
+      FOREACH_CANDIDATE(world, i, range, ++count);
+    nlist->start[i+1] = count;
+  }
+}
+
+static void nlist_fill_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct nlist *nlist = world->nlist;
+  double range = nlist->cutoff+nlist->skin;
+  for (int i = work->start; i < work->end; ++i) {
+    int *items = nlist->items+nlist->start[i];
+    nlist->built_pos[i] = world->vertices[i].pos;
+    if (world->vertices[i].weight > 0)
+      FOREACH_CANDIDATE(world, i, range, *items++ = j);
+  }
+}
+
+static void nlist_displacement_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct nlist *nlist = world->nlist;
+  double maxdisp = 0;
+  for (int i = work->start; i < work->end; ++i) {
+    if (world->vertices[i].weight <= 0)
+      continue;
+    const struct pair *pos = &world->vertices[i].pos, *built = &nlist->built_pos[i];
+    double disp = hypot(pos->x-built->x, pos->y-built->y);
+    if (disp > maxdisp)
+      maxdisp = disp;
+  }
+  work->weight = maxdisp;
+}
+
+static void nlist_build(struct world *world)
+{
+  struct nlist *nlist = world->nlist;
+  struct work_phase work_ops = {
+    .work = &nlist_count_work
+  };
+  grid_build(world, nlist->cutoff+nlist->skin);
+  nlist->start[0] = 0;
+  give_work(world->pool, &work_ops, world, world->world_work);
+  for (int i = 0; i < world->nitems; ++i)
+    nlist->start[i+1] += nlist->start[i];
+  if ((size_t)nlist->start[world->nitems] > nlist->capacity) {
+    nlist->capacity = nlist->start[world->nitems]+nlist->start[world->nitems]/4;
+    free(nlist->items);
+    nlist->items = malloc(nlist->capacity*sizeof(int));
+  }
+  work_ops.work = &nlist_fill_work;
+  give_work(world->pool, &work_ops, world, world->world_work);
+  nlist->valid = 1;
+  ++nlist->rebuilds;
+}
+
+/*
+  Makes sure the lists hold every pair closer than cutoff.  They are
+  rebuilt when the distances asked for change or when the largest
+  move since the last build is over half the skin, as then two
+  vertices may have closed in from beyond cutoff+skin.  Returns
+  whether the lists were rebuilt.
+*/
+int nlist_update(struct world *world, double cutoff, double skin)
+{
+  struct nlist *nlist = world->nlist;
+  if (nlist->valid && nlist->cutoff == cutoff && nlist->skin == skin) {
+    struct work_phase work_ops = {
+      .work = &nlist_displacement_work
+    };
+    double maxdisp = 0;
+    give_work(world->pool, &work_ops, world, world->world_work);
+    struct world_work **workptr = world->world_work;
+    do {
+      if ((*workptr)->weight > maxdisp)
+	maxdisp = (*workptr)->weight;
+    } while (*(++workptr));
+    if (maxdisp <= skin/2)
+      return 0;
+  }
+  nlist->cutoff = cutoff;
+  nlist->skin = skin;
+  nlist_build(world);
+  return 1;
+}
@@ -0,0 +1,49 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _NLIST_H
+#define _NLIST_H
+
+#include "world.h"
+
+/*
+  Verlet neighbour lists: for every live vertex, the live vertices
+  within cutoff+skin when the lists were built.  They stay good for
+  any distance up to cutoff until some vertex has moved skin/2.
+*/
+
+struct nlist {
+  double cutoff, skin;
+  int *start;		// index: vertex, neighbours are items[start[i]..start[i+1]]
+  int *items;
+  size_t capacity;
+  struct pair *built_pos;	// index: vertex
+  int valid;
+  int rebuilds;
+};
+
+void init_nlist(struct world *);
+void free_nlist(struct nlist *);
+size_t nlist_memory(int);
+int nlist_update(struct world *, double, double);
+
+#endif
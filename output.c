@@ -0,0 +1,219 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "world.h"
+#include "worker.h"
+#include "dtoa.h"
+#include "output.h"
+
+#define OUTPUT_CHUNK 1024
+// Upper bound for one formatted vertex, see format_vertex
+#define VERTEX_MAXLEN 256
+
+struct output_work {
+  int start, end;
+  int precision, compact;
+  char *buf;
+  size_t len;
+};
+
+/*
+  The output is written directly rather than by building a jansson
+  tree and dumping it.  Chunks of vertices are formatted in parallel
+  into their own buffers, which then go out with writev.  The layout
+  matches json_dump_file with JSON_INDENT(2) or JSON_COMPACT, so
+  earlier consumers and load_world_positions read it as before.
+*/
+
+char *put_string(char *p, const char *s)
+{
+  while (*s)
+    *p++ = *s++;
+  return p;
+}
+
+char *put_int(char *p, long long value)
+{
+  char digits[24];
+  int len = 0;
+  unsigned long long n = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+  if (value < 0)
+    *p++ = '-';
+  do {
+    digits[len++] = '0'+n%10;
+    n /= 10;
+  } while (n);
+  while (len > 0)
+    *p++ = digits[--len];
+  return p;
+}
+
+char *put_real(char *p, double value, int precision)
+{
+  if (precision > 0)
+    return p+format_fixed(p, value, precision);
+  return p+format_double(p, value);
+}
+
+// Every vertex starts with a separator, the first one is cut off later
+static char *format_vertex(struct output_work *work, char *p, int64_t id, const struct vertex *v)
+{
+  if (work->compact) {
+    p = put_string(p, ",\"");
+    p = put_int(p, id);
+    p = put_string(p, "\":{\"x\":");
+    p = put_real(p, v->pos.x, work->precision);
+    p = put_string(p, ",\"y\":");
+    p = put_real(p, v->pos.y, work->precision);
+    p = put_string(p, ",\"radius\":");
+    p = put_real(p, v->radius, work->precision);
+    p = put_string(p, ",\"weight\":");
+    p = put_int(p, (long long)v->weight);
+    *p++ = '}';
+  } else {
+    p = put_string(p, ",\n  \"");
+    p = put_int(p, id);
+    p = put_string(p, "\": {\n    \"x\": ");
+    p = put_real(p, v->pos.x, work->precision);
+    p = put_string(p, ",\n    \"y\": ");
+    p = put_real(p, v->pos.y, work->precision);
+    p = put_string(p, ",\n    \"radius\": ");
+    p = put_real(p, v->radius, work->precision);
+    p = put_string(p, ",\n    \"weight\": ");
+    p = put_int(p, (long long)v->weight);
+    p = put_string(p, "\n  }");
+  }
+  return p;
+}
+
+static void output_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct output_work *work = data;
+  char *p = work->buf = malloc((work->end-work->start)*VERTEX_MAXLEN);
+  for (int i = work->start; i < work->end; ++i) {
+    struct vertex *v = &world->vertices[i];
+    if (v->weight <= 0)
+      continue;
+    p = format_vertex(work, p, world->mapping[i+1], v);
+  }
+  work->len = p-work->buf;
+}
+
+size_t output_memory(int nitems)
+{
+  return (size_t)nitems*VERTEX_MAXLEN;
+}
+
+void write_all(int fd, struct iovec *iov, int iovcnt, const char *path)
+{
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base+n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void write_world(struct world *world, const char *path)
+{
+  int nwork = world->nitems/OUTPUT_CHUNK+1;
+  struct output_work *array = malloc(nwork*sizeof(struct output_work));
+  struct output_work **work = malloc((nwork+1)*sizeof(struct output_work *));
+  struct iovec *iov = malloc((nwork+2)*sizeof(struct iovec));
+  int iovcnt = 0;
+  for (int i = 0; i < nwork; ++i) {
+    struct output_work value = {
+      .start = i*OUTPUT_CHUNK,
+      .end = (i+1)*OUTPUT_CHUNK < world->nitems ? (i+1)*OUTPUT_CHUNK : world->nitems,
+      .precision = world->options->precision,
+      .compact = world->options->compact
+    };
+    array[i] = value;
+    work[i] = &array[i];
+  }
+  work[nwork] = NULL;
+  struct work_phase output_ops = {
+    .work = &output_work
+  };
+  give_work(world->pool, &output_ops, world, work);
+
+  iov[iovcnt].iov_base = (char *)"{";
+  iov[iovcnt++].iov_len = 1;
+  for (int i = 0; i < nwork; ++i) {
+    if (array[i].len == 0)
+      continue;
+    iov[iovcnt].iov_base = array[i].buf;
+    iov[iovcnt].iov_len = array[i].len;
+    if (iovcnt == 1) {
+      // Drop the leading separator of the first vertex
+      iov[iovcnt].iov_base = array[i].buf+1;
+      --iov[iovcnt].iov_len;
+    }
+    ++iovcnt;
+  }
+  if (iovcnt == 1 || world->options->compact)
+    iov[iovcnt].iov_base = (char *)"}";
+  else
+    iov[iovcnt].iov_base = (char *)"\n}";
+  iov[iovcnt].iov_len = strlen(iov[iovcnt].iov_base);
+  ++iovcnt;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  write_all(fd, iov, iovcnt, path);
+  if (close(fd) < 0) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  for (int i = 0; i < nwork; ++i)
+    free(array[i].buf);
+  free(iov);
+  free(work);
+  free(array);
+}
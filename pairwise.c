@@ -0,0 +1,224 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "world.h"
+#include "worker.h"
+#include "pairwise.h"
+
+// Vertices per tile side
+#define TILE 256
+/*
+  Number of force accumulators.  Fixed rather than per thread, so that
+  the summation order and the layout don't depend on -j.
+*/
+#define PAIR_GROUPS 16
+
+struct tile {
+  int i_start, i_end, j_start, j_end;
+};
+
+struct pair_work {
+  struct tile *tiles;
+  int ntiles;
+  struct pair *force;		// index: vertex
+};
+
+struct pairwise {
+  struct tile *tiles;
+  struct pair_work groups[PAIR_GROUPS];
+  struct pair_work *work[PAIR_GROUPS+1];
+};
+
+/*
+  Each unordered pair of vertices is visited once.  Distance, normal
+  and the squared stretch are shared, only the weight dependent
+  factors are worked out for both ends.  The vertex pairs are cut into
+  square tiles for cache reuse and the tiles are dealt out to a fixed
+  number of groups, each with an accumulator of its own, so no locking
+  is needed.  The accumulators are summed in group order afterwards.
+*/
+
+void init_pairwise(struct world *world)
+{
+  struct pairwise *pairwise = malloc(sizeof(struct pairwise));
+  int nblocks = (world->nitems+TILE-1)/TILE;
+  int ntiles = nblocks*(nblocks+1)/2;
+  double load[PAIR_GROUPS] = {0};
+  int *group_of = malloc(ntiles*sizeof(int)), t = 0;
+  pairwise->tiles = malloc(ntiles*sizeof(struct tile));
+  for (int g = 0; g < PAIR_GROUPS; ++g)
+    pairwise->groups[g].ntiles = 0;
+  // Greedy balancing, diagonal tiles cost half
+  for (int bi = 0; bi < nblocks; ++bi) {
+    for (int bj = bi; bj < nblocks; ++bj, ++t) {
+      struct tile tile = {
+	.i_start = bi*TILE,
+	.i_end = (bi+1)*TILE < world->nitems ? (bi+1)*TILE : world->nitems,
+	.j_start = bj*TILE,
+	.j_end = (bj+1)*TILE < world->nitems ? (bj+1)*TILE : world->nitems
+      };
+      double cost = (double)(tile.i_end-tile.i_start)*(tile.j_end-tile.j_start);
+      int best = 0;
+      if (bi == bj)
+	cost /= 2;
+      for (int g = 1; g < PAIR_GROUPS; ++g) {
+	if (load[g] < load[best])
+	  best = g;
+      }
+      load[best] += cost;
+      group_of[t] = best;
+      ++pairwise->groups[best].ntiles;
+      pairwise->tiles[t] = tile;
+    }
+  }
+  // Lay each group's tiles out contiguously, keeping their order
+  struct tile *sorted = malloc(ntiles*sizeof(struct tile)), *ptr = sorted;
+  for (int g = 0; g < PAIR_GROUPS; ++g) {
+    struct pair_work *group = &pairwise->groups[g];
+    group->tiles = ptr;
+    for (t = 0; t < ntiles; ++t) {
+      if (group_of[t] == g)
+	*ptr++ = pairwise->tiles[t];
+    }
+    group->force = malloc(world->nitems*sizeof(struct pair));
+    pairwise->work[g] = group;
+  }
+  pairwise->work[PAIR_GROUPS] = NULL;
+  free(pairwise->tiles);
+  free(group_of);
+  pairwise->tiles = sorted;
+  world->pairwise = pairwise;
+  world->force = malloc(world->nitems*sizeof(struct pair));
+}
+
+void free_pairwise(struct world *world)
+{
+  for (int g = 0; g < PAIR_GROUPS; ++g)
+    free(world->pairwise->groups[g].force);
+  free(world->pairwise->tiles);
+  free(world->pairwise);
+  free(world->force);
+  world->pairwise = NULL;
+  world->force = NULL;
+}
+
+size_t pairwise_memory(int nitems)
+{
+  size_t nblocks = (nitems+TILE-1)/TILE;
+  return (PAIR_GROUPS+1)*(size_t)nitems*sizeof(struct pair)+nblocks*(nblocks+1)/2*sizeof(struct tile);
+}
+
+static double pair_energy(const struct world *world, const struct vertex *src,
+			  float edge_weight, double dist, double relax, double stretch)
+{
+  double energy = 0;
+  if (edge_weight > 0) {
+    energy = edge_weight / src->weight * stretch / (src->weight + relax);
+    if (dist < relax)
+      energy = -energy;
+  }
+  double repulsionenergy = (src->weight+relax)*(src->weight+relax)/dist;
+  double cap = world->repulsioncap*src->weight;
+  if (repulsionenergy > cap)
+    repulsionenergy = cap;
+  repulsionenergy -= 0.01;
+  return energy-repulsionenergy;
+}
+
+static void pair_tile(const struct world *world, const struct tile *tile, struct pair *force)
+{
+  const struct vertex *vertices = world->vertices;
+  for (int i = tile->i_start; i < tile->i_end; ++i) {
+    const struct vertex *v1 = &vertices[i];
+    if (v1->weight <= 0)
+      continue;
+    const struct edge *edge = world->edges ? world->edges+(size_t)i*world->nitems : NULL;
+    const struct adjacency *cursor = world->adj+world->adj_start[i];
+    const struct adjacency *adj_end = world->adj+world->adj_start[i+1];
+    struct pair sum = {0};
+    int j = tile->j_start > i ? tile->j_start : i+1;
+    for (; j < tile->j_end; ++j) {
+      const struct vertex *v2 = &vertices[j];
+      if (v2->weight <= 0)
+	continue;
+      double dx = v2->pos.x-v1->pos.x, dy = v2->pos.y-v1->pos.y;
+      double dist = hypot(dx, dy);
+      double relax = v1->radius+v2->radius+RELAX_EXTRA;
+      double stretch = (dist-relax)*(dist-relax);
+      double normX = dx/dist, normY = dy/dist;
+      float edge_weight = edge ? edge[j].weight : adjacency_walk(&cursor, adj_end, j);
+      double e1 = pair_energy(world, v2, edge_weight, dist, relax, stretch);
+      double e2 = pair_energy(world, v1, edge_weight, dist, relax, stretch);
+      sum.x += e1*normX;
+      sum.y += e1*normY;
+      force[j].x -= e2*normX;
+      force[j].y -= e2*normY;
+    }
+    force[i].x += sum.x;
+    force[i].y += sum.y;
+  }
+}
+
+static void pair_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct pair_work *group = data;
+  memset(group->force, 0, world->nitems*sizeof(struct pair));
+  for (int t = 0; t < group->ntiles; ++t)
+    pair_tile(world, &group->tiles[t], group->force);
+}
+
+static void pair_reduce_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct pairwise *pairwise = world->pairwise;
+  for (int i = work->start; i < work->end; ++i) {
+    struct pair force = {0};
+    for (int g = 0; g < PAIR_GROUPS; ++g) {
+      force.x += pairwise->groups[g].force[i].x;
+      force.y += pairwise->groups[g].force[i].y;
+    }
+    float weight = world->vertices[i].weight;
+    if (weight > 0) {
+      force.x /= weight;
+      force.y /= weight;
+    }
+    world->force[i] = force;
+  }
+}
+
+// Leaves the unclamped move of every vertex in world->force
+void pairwise_forces(struct world *world)
+{
+  struct work_phase work_ops = {
+    .work = &pair_work
+  };
+  give_work(world->pool, &work_ops, world, world->pairwise->work);
+  work_ops.work = &pair_reduce_work;
+  give_work(world->pool, &work_ops, world, world->world_work);
+}
@@ -0,0 +1,215 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "world.h"
+#include "prune.h"
+
+/*
+  Edge pruning.  Co-pick graphs carry a lot of weak incidental edges,
+  most of weight one from a single pick, and each one is work in the
+  attraction term every step.  Three filters pick the edges worth
+  keeping, and an edge has to pass all that are set:
+
+  --prune-weight W  weight at least W
+  --prune-top K     among the K heaviest edges of either end
+  --prune-alpha A   significant at level A for either end under the
+                    disparity filter: with s the weight sum and k the
+                    degree of an end, (1-w/s)^(k-1) < A.  Ends with a
+                    single edge always keep it.
+
+  On top of what passes, a maximum spanning forest of the whole graph
+  is always kept, so the kept component stays connected through its
+  heaviest edges and mark_closure finds the same vertices either way.
+  The dense matrix, when there is one, loses the same edges.
+*/
+
+struct undirected {
+  float weight;
+  int i, k;		// k is the entry in row i, with adj[k].j > i
+};
+
+static int undirected_comparator(const void *a, const void *b)
+{
+  const struct undirected *e1 = a, *e2 = b;
+  if (e1->weight != e2->weight)
+    return e1->weight > e2->weight ? -1 : 1;
+  return e1->k-e2->k;
+}
+
+static int find(int *parent, int i)
+{
+  while (parent[i] != i)
+    i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+// Entry of i in row j, the rows being sorted by j
+static int reverse_entry(const struct world *world, int i, int j)
+{
+  int lo = world->adj_start[j], hi = world->adj_start[j+1]-1;
+  while (lo < hi) {
+    int mid = (lo+hi)/2;
+    if (world->adj[mid].j < i)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int weight_comparator(const void *a, const void *b)
+{
+  float w1 = *(const float *)a, w2 = *(const float *)b;
+  return w1 > w2 ? -1 : w1 < w2;
+}
+
+// Marks the entries of row i among its top heaviest, ties at the cut included
+static void mark_top(const struct world *world, int i, int top, float *scratch, unsigned char *wanted)
+{
+  int start = world->adj_start[i], degree = world->adj_start[i+1]-start;
+  if (degree <= top) {
+    for (int k = start; k < start+degree; ++k)
+      wanted[k] = 1;
+    return;
+  }
+  for (int k = 0; k < degree; ++k)
+    scratch[k] = world->adj[start+k].weight;
+  qsort(scratch, degree, sizeof(float), weight_comparator);
+  float cut = scratch[top-1];
+  for (int k = start; k < start+degree; ++k)
+    if (world->adj[k].weight >= cut)
+      wanted[k] = 1;
+}
+
+static void mark_disparity(const struct world *world, int i, double alpha, unsigned char *wanted)
+{
+  int start = world->adj_start[i], degree = world->adj_start[i+1]-start;
+  double strength = 0;
+  for (int k = start; k < start+degree; ++k)
+    strength += world->adj[k].weight;
+  for (int k = start; k < start+degree; ++k)
+    if (degree == 1 || pow(1-world->adj[k].weight/strength, degree-1) < alpha)
+      wanted[k] = 1;
+}
+
+void prune_edges(struct world *world)
+{
+  const struct options *options = world->options;
+  int n = world->nitems, nadj = world->adj_start[n], maxdegree = 0;
+  unsigned char *keep = malloc(nadj), *top = NULL, *disparity = NULL;
+  for (int i = 0; i < n; ++i)
+    if (world->adj_start[i+1]-world->adj_start[i] > maxdegree)
+      maxdegree = world->adj_start[i+1]-world->adj_start[i];
+
+  // Either end wanting an edge is enough for the per vertex filters
+  if (options->prune_top > 0) {
+    float *scratch = malloc(maxdegree*sizeof(float));
+    top = calloc(nadj, 1);
+    for (int i = 0; i < n; ++i)
+      mark_top(world, i, options->prune_top, scratch, top);
+    free(scratch);
+  }
+  if (options->prune_alpha > 0) {
+    disparity = calloc(nadj, 1);
+    for (int i = 0; i < n; ++i)
+      mark_disparity(world, i, options->prune_alpha, disparity);
+  }
+  int nedges = 0;
+  for (int i = 0; i < n; ++i) {
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      int j = world->adj[k].j;
+      if (j < i)
+	continue;
+      int r = reverse_entry(world, i, j);
+      keep[k] = world->adj[k].weight >= options->prune_weight
+	&& (!top || top[k] || top[r])
+	&& (!disparity || disparity[k] || disparity[r]);
+      keep[r] = keep[k];
+      ++nedges;
+    }
+  }
+  free(top);
+  free(disparity);
+
+  // Kruskal over the heaviest edges first
+  struct undirected *edges = malloc(nedges*sizeof(struct undirected));
+  int *parent = malloc(n*sizeof(int)), nkept = 0, nforest = 0;
+  nedges = 0;
+  for (int i = 0; i < n; ++i) {
+    parent[i] = i;
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      if (world->adj[k].j > i) {
+	struct undirected e = { .weight = world->adj[k].weight, .i = i, .k = k };
+	edges[nedges++] = e;
+      }
+    }
+  }
+  qsort(edges, nedges, sizeof(struct undirected), undirected_comparator);
+  for (int e = 0; e < nedges; ++e) {
+    int i = edges[e].i, j = world->adj[edges[e].k].j;
+    int a = find(parent, i), b = find(parent, j);
+    if (a == b)
+      continue;
+    parent[a] = b;
+    if (!keep[edges[e].k]) {
+      keep[edges[e].k] = keep[reverse_entry(world, i, j)] = 1;
+      ++nforest;
+    }
+  }
+  free(edges);
+  free(parent);
+
+  // Compact the rows in place, they stay sorted by j
+  int to = 0;
+  for (int i = 0; i < n; ++i) {
+    int from = world->adj_start[i];
+    world->adj_start[i] = to;
+    for (int k = from; k < world->adj_start[i+1]; ++k) {
+      if (keep[k]) {
+	world->adj[to++] = world->adj[k];
+	continue;
+      }
+      if (world->edges) {
+	world->edges[(size_t)i*n+world->adj[k].j].weight = 0;
+      }
+    }
+  }
+  world->adj_start[n] = to;
+  world->adj = realloc(world->adj, (to ? to : 1)*sizeof(struct adjacency));
+  nkept = to/2;
+  free(keep);
+
+  if (options->verbose)
+    fprintf(stderr, "forcelayout: pruned %i of %i edges, kept %i (%i of them for connectivity)\n",
+	    nedges-nkept, nedges, nkept, nforest);
+}
+
+// nedges undirected, each in two rows
+size_t prune_memory(int nitems, size_t nedges)
+{
+  return 2*nedges*3+nedges*sizeof(struct undirected)+nitems*sizeof(int);
+}
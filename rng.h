@@ -0,0 +1,73 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef _RNG_H
+#define _RNG_H
+
+#include <stdint.h>
+
+/*
+  Small and fast xorshift64* generator.  Streams are seeded from a
+  user seed mixed with whatever identifies the stream, never from
+  thread identity, so runs stay reproducible.
+*/
+
+struct rng {
+  uint64_t s;
+};
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27))*0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static inline void rng_seed(struct rng *rng, uint64_t seed, uint64_t a, uint64_t b)
+{
+  rng->s = splitmix64(splitmix64(splitmix64(seed)+a)+b);
+  if (!rng->s)
+    rng->s = 1;
+}
+
+static inline uint64_t rng_next(struct rng *rng)
+{
+  rng->s ^= rng->s >> 12;
+  rng->s ^= rng->s << 25;
+  rng->s ^= rng->s >> 27;
+  return rng->s*0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, n)
+static inline uint32_t rng_below(struct rng *rng, uint32_t n)
+{
+  return ((rng_next(rng) >> 32)*n) >> 32;
+}
+
+// Uniform in [0, 1)
+static inline double rng_double(struct rng *rng)
+{
+  return (rng_next(rng) >> 11)*(1.0/9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,162 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <math.h>
+#include "world.h"
+#include "worker.h"
+#include "rng.h"
+#include "nlist.h"
+#include "force.h"
+#include "sampled.h"
+
+/*
+  Force engine for graphs too big for all pairs.  Attraction is exact
+  and walks the adjacency lists.  Repulsion is estimated from a fixed
+  number of live vertices drawn at random for every vertex and step,
+  scaled up to stand for all of them, which makes a step O(N*k).
+  Vertices closer than NEAR_CUTOFF relax distances, where repulsion is
+  strongest, are taken exactly from the Verlet lists and left out of
+  the samples.
+
+  Each vertex draws from its own stream, seeded from the seed option,
+  the step number and the vertex, so the result doesn't depend on the
+  work unit size, on which thread runs what or on how --ranks splits
+  the vertices.
+*/
+
+// Near field radius in units of the largest relax distance
+#define NEAR_CUTOFF 1
+#define NEAR_SKIN 0.5
+
+void init_sampled(struct world *world)
+{
+  world->force = malloc(world->nitems*sizeof(struct pair));
+}
+
+size_t sampled_memory(int nitems)
+{
+  return nitems*sizeof(struct pair);
+}
+
+static double repulsion(const struct world *world, const struct vertex *v1,
+			const struct vertex *v2, double dist)
+{
+  double relax = v1->radius+v2->radius+RELAX_EXTRA;
+  double repulsionenergy = (v2->weight+relax)*(v2->weight+relax)/dist;
+  double cap = world->repulsioncap*v2->weight;
+  if (repulsionenergy > cap)
+    repulsionenergy = cap;
+  return repulsionenergy-0.01;
+}
+
+static struct pair sampled_force(const struct world *world, struct rng *rng, int i)
+{
+  const struct vertex *v1 = &world->vertices[i];
+  struct pair force = {0}, repulse = {0};
+  for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+    const struct vertex *v2 = &world->vertices[world->adj[k].j];
+    double relax = v1->radius+v2->radius+RELAX_EXTRA;
+    double dist = hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
+    double energy = world->adj[k].weight / v2->weight * (dist-relax)*(dist-relax) / (v2->weight + relax);
+    if (dist < relax)
+      energy = -energy;
+    force.x += energy*(v2->pos.x-v1->pos.x)/dist;
+    force.y += energy*(v2->pos.y-v1->pos.y)/dist;
+  }
+
+  int others = world->nlive-1, samples = world->options->samples;
+  double scale = 1;
+  if (samples >= others) {
+    // Few enough to do exactly
+    for (int k = 0; k < world->nlive; ++k) {
+      const struct vertex *v2 = &world->vertices[world->live[k]];
+      if (world->live[k] == i)
+	continue;
+      double dist = hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
+      double energy = repulsion(world, v1, v2, dist);
+      repulse.x += energy*(v2->pos.x-v1->pos.x)/dist;
+      repulse.y += energy*(v2->pos.y-v1->pos.y)/dist;
+    }
+  } else {
+    const struct nlist *nlist = world->nlist;
+    double cutoff = nlist->cutoff;
+    struct pair near = {0};
+    for (int k = nlist->start[i]; k < nlist->start[i+1]; ++k) {
+      const struct vertex *v2 = &world->vertices[nlist->items[k]];
+      double dist = hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
+      if (dist >= cutoff)
+	continue;
+      double energy = repulsion(world, v1, v2, dist);
+      near.x += energy*(v2->pos.x-v1->pos.x)/dist;
+      near.y += energy*(v2->pos.y-v1->pos.y)/dist;
+    }
+    for (int k = 0; k < samples; ++k) {
+      // Uniform over the live vertices other than i
+      int j = world->live[rng_below(rng, others)];
+      if (j == i)
+	j = world->live[others];
+      const struct vertex *v2 = &world->vertices[j];
+      double dist = hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
+      // Counted exactly above, this keeps the far estimate unbiased
+      if (dist < cutoff)
+	continue;
+      double energy = repulsion(world, v1, v2, dist);
+      repulse.x += energy*(v2->pos.x-v1->pos.x)/dist;
+      repulse.y += energy*(v2->pos.y-v1->pos.y)/dist;
+    }
+    scale = (double)others/samples;
+    repulse.x += near.x/scale;
+    repulse.y += near.y/scale;
+  }
+
+  force.x = (force.x-repulse.x*scale)/v1->weight;
+  force.y = (force.y-repulse.y*scale)/v1->weight;
+  return force;
+}
+
+static void sampled_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  for (int i = work->start; i < work->end; ++i) {
+    if (world->vertices[i].weight <= 0 || vertex_frozen(world, i))
+      continue;
+    struct rng rng;
+    rng_seed(&rng, world->options->seed, world->step, i);
+    world->force[i] = sampled_force(world, &rng, i);
+  }
+}
+
+// Leaves the unclamped move of every vertex in world->force
+void sampled_forces(struct world *world)
+{
+  struct work_phase work_ops = {
+    .work = &sampled_work
+  };
+  double relax = 2*world->maxradius+RELAX_EXTRA;
+  if (world->options->samples < world->nlive-1)
+    nlist_update(world, NEAR_CUTOFF*relax, NEAR_SKIN*relax);
+  give_work(world->pool, &work_ops, world, world->local_work);
+}
@@ -22,21 +22,29 @@
 
 #include <config.h>
 
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "world.h"
 #include "worker.h"
+#include "grid.h"
+#include "nlist.h"
+
+// Verlet list skin, relative to the largest overlap distance
+#define SPARSIFY_SKIN 0.5
 
 static double resolve_overlap(struct world *world, struct pair *newpos, int i) {
   double overlap = 0;
   struct vertex *v1 = &world->vertices[i];
-  if (v1->weight <= 0)
+  struct nlist *nlist = world->nlist;
+  *newpos = v1->pos;
+  if (v1->weight <= 0 || !world->active[i])
     return 0;
   struct pair force = {0};
-  for (int j = 0; j < world->nitems; ++j) {
+  for (int k = nlist->start[i]; k < nlist->start[i+1]; ++k) {
+    int j = nlist->items[k];
     struct vertex *v2 = &world->vertices[j];
-    if (i == j || v2->weight <= 0)
-      continue;
-    
+
     float relax = v1->radius+v2->radius+RELAX_EXTRA/2;
     // hypot is expensive.
     double taxidist = fabs(v1->pos.x-v2->pos.x)+fabs(v1->pos.y-v2->pos.y);
@@ -80,33 +88,88 @@ static void sparsify_work(void *cfg, void *data)
   work->energy = 0;
   struct pair *newpos = work->data;
   for (int i = work->start; i < work->end; ++i, ++newpos) {
-    work->energy += resolve_overlap(world, newpos, i);
+    double overlap = resolve_overlap(world, newpos, i);
+    // Only vertices with an overlap move
+    world->unsettled[i] = overlap > 0;
+    work->energy += overlap;
   }
 }
 
-// Make the map sparser to resolve overlaps
-void sparsify_world(struct world *world)
+// Flag the unsettled vertices and everything in reach of them
+static void activate_work(void *cfg, void *data)
 {
-  // First, shift everything by a constant factor
-  double total_overlap = 0;
-  int noverlap = 0;
-  for (int i = 0; i < world->nitems; ++i) {
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct nlist *nlist = world->nlist;
+  for (int i = work->start; i < work->end; ++i) {
+    if (!world->unsettled[i])
+      continue;
+    __atomic_store_n(&world->active[i], 1, __ATOMIC_RELAXED);
+    for (int k = nlist->start[i]; k < nlist->start[i+1]; ++k)
+      __atomic_store_n(&world->active[nlist->items[k]], 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void overlap_scan_work(void *cfg, void *data)
+{
+  struct world *world = cfg;
+  struct world_work *work = data;
+  struct grid *grid = world->grid;
+  unsigned buckets[9];
+  work->energy = 0;
+  work->weight = 0;
+  for (int i = work->start; i < work->end; ++i) {
     struct vertex *v1 = &world->vertices[i], *v2;
     if (v1->weight <= 0)
       continue;
-    for (int j = i+1; j < world->nitems; ++j) {
-      v2 = &world->vertices[j];
-      if (v2->weight <= 0)
-	continue;
-      double dist = hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
-      double relax = v1->radius + v2->radius + RELAX_EXTRA;
-      if (dist < relax) {
-	noverlap += v1->weight+v2->weight;
-	total_overlap += v2->weight*count_overlap(dist, v1, v2);
-	total_overlap += v1->weight*count_overlap(dist, v2, v1);
+    int nbuckets = grid_neighbor_buckets(grid, &v1->pos, buckets);
+    for (int b = 0; b < nbuckets; ++b) {
+      const int *ptr = grid->items+grid->bucket_start[buckets[b]];
+      const int *end = grid->items+grid->bucket_start[buckets[b]+1];
+      for (; ptr < end; ++ptr) {
+	int j = *ptr;
+	// Each pair once, like the full scan over j > i
+	if (j <= i)
+	  continue;
+	v2 = &world->vertices[j];
+	double dist = hypot(v1->pos.x-v2->pos.x, v1->pos.y-v2->pos.y);
+	double relax = v1->radius + v2->radius + RELAX_EXTRA;
+	if (dist < relax) {
+	  work->weight += v1->weight+v2->weight;
+	  work->energy += v2->weight*count_overlap(dist, v1, v2);
+	  work->energy += v1->weight*count_overlap(dist, v2, v1);
+	}
       }
     }
   }
+}
+
+void init_sparsify(struct world *world)
+{
+  world->active = malloc(world->nitems);
+  world->unsettled = malloc(world->nitems);
+}
+
+// Make the map sparser to resolve overlaps
+void sparsify_world(struct world *world)
+{
+  // First, shift everything by a constant factor
+  struct work_phase work_ops = {
+    .work = &overlap_scan_work
+  };
+  double total_overlap = 0, noverlap = 0;
+  // Only pairs closer than the largest relax distance can overlap
+  grid_build(world, 2*world->maxradius+RELAX_EXTRA);
+  give_work(world->pool, &work_ops, world, world->world_work);
+  struct world_work **workptr = world->world_work;
+  do {
+    total_overlap += (*workptr)->energy;
+    noverlap += (*workptr)->weight;
+  } while (*(++workptr));
+  // Everything gets examined on the first sparsify step
+  memset(world->unsettled, 1, world->nitems);
+  if (noverlap == 0)
+    return;
   total_overlap /= noverlap;
 
   for (int i = 0; i < world->nitems; ++i) {
@@ -115,13 +178,29 @@ void sparsify_world(struct world *world)
   }
 }
 
-  // Then, bump vertices around until overlaps are resolved
+/*
+  Then, bump vertices around until overlaps are resolved.
+
+  A vertex is unsettled when it overlapped something on the previous
+  step, and only those move.  A pair that overlaps now either
+  overlapped then too or has a member that moved, so it has an
+  unsettled member and is on its neighbour list.  Looking at the
+  unsettled vertices and their neighbours therefore finds
+  every overlap, each vertex moves exactly as if all were examined and
+  a zero result still means no overlaps are left.
+*/
 double sparsify_step(struct world *world)
 {
   struct work_phase work_ops = {
-    .work = &sparsify_work
+    .work = &activate_work
   };
   double energy = 0;
+  double cutoff = 2*world->maxradius+RELAX_EXTRA;
+  // Late steps only nudge a little, the lists then last many steps
+  nlist_update(world, cutoff, cutoff*SPARSIFY_SKIN);
+  memset(world->active, 0, world->nitems);
+  give_work(world->pool, &work_ops, world, world->world_work);
+  work_ops.work = &sparsify_work;
   give_work(world->pool, &work_ops, world, world->world_work);
   struct world_work **workptr = world->world_work;
   do {
@@ -132,6 +211,5 @@ double sparsify_step(struct world *world)
     }
     energy += work->energy;
   } while (*(++workptr));
-      
   return energy;
 }
@@ -23,6 +23,7 @@
 #ifndef _SPARSIFY_H
 #define _SPARSIFY_H
 
+void init_sparsify(struct world *);
 void sparsify_world(struct world *);
 double sparsify_step(struct world *);
 
@@ -0,0 +1,218 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "world.h"
+#include "worker.h"
+#include "rng.h"
+#include "spectral.h"
+
+/*
+  Spectral start.  The default rings put vertices in id order, which
+  has nothing to do with the graph, and the first several hundred
+  force steps go to untangling them.  --spectral starts from the two
+  leading nontrivial eigenvectors of the degree normalized co-pick
+  Laplacian instead, where linked items already sit close together.
+
+  They are approached by subspace iteration: both coordinates go
+  through x <- (x + D^-1 W x)/2 at once, whose leading eigenvector is
+  the constant one and whose next two are the ones wanted, and are
+  then made D-orthonormal to the constant and to each other.  The
+  products run on the pool over the work units; the orthogonalizing
+  sums are serial and in live order, so the start doesn't depend on
+  the thread count.
+
+  The iteration is stopped early on purpose.  Fully converged vectors
+  tend to single out a few loosely attached groups and leave the rest
+  on a heap, while a few dozen products smooth a random start along
+  the edges, which is what the force steps need.  For the same reason
+  only the order along each axis is kept: ranks spread the vertices
+  evenly over a square of about the size layouts settle to, plus a
+  tiny copy of the rings so that no two start on the same spot.
+*/
+
+#define SPECTRAL_ROUNDS 50	// most products
+#define SPECTRAL_TOLERANCE 1e-7	// D-norm of the last change
+#define SPECTRAL_SPREAD 3.0	// RMS distance from the centre over sqrt of the total weight
+#define SPECTRAL_JITTER 0.01	// share of the rings kept
+
+struct spectral {
+  struct world *world;
+  struct pair *cur, *next;	// index: vertex
+  double *degree;
+};
+
+struct ranked {
+  double value;
+  int i;
+};
+
+static int ranked_comparator(const void *a, const void *b)
+{
+  const struct ranked *r1 = a, *r2 = b;
+  if (r1->value != r2->value)
+    return r1->value < r2->value ? -1 : 1;
+  return r1->i-r2->i;
+}
+
+static void product_work(void *cfg, void *data)
+{
+  struct spectral *spectral = cfg;
+  struct world *world = spectral->world;
+  struct world_work *work = data;
+  for (int i = work->start; i < work->end; ++i) {
+    if (world->vertices[i].weight <= 0 || spectral->degree[i] <= 0)
+      continue;
+    struct pair sum = {0};
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      const struct pair *x = &spectral->cur[world->adj[k].j];
+      sum.x += world->adj[k].weight*x->x;
+      sum.y += world->adj[k].weight*x->y;
+    }
+    spectral->next[i].x = (spectral->cur[i].x+sum.x/spectral->degree[i])/2;
+    spectral->next[i].y = (spectral->cur[i].y+sum.y/spectral->degree[i])/2;
+  }
+}
+
+// D-orthonormalizes next against the constant vector and x against y
+static void orthonormalize(struct world *world, struct spectral *spectral)
+{
+  struct pair *x = spectral->next;
+  const double *d = spectral->degree;
+  double total = 0, mean_x = 0, mean_y = 0;
+  for (int l = 0; l < world->nlive; ++l) {
+    int i = world->live[l];
+    total += d[i];
+    mean_x += d[i]*x[i].x;
+    mean_y += d[i]*x[i].y;
+  }
+  mean_x /= total;
+  mean_y /= total;
+  double norm = 0;
+  for (int l = 0; l < world->nlive; ++l) {
+    int i = world->live[l];
+    x[i].x -= mean_x;
+    x[i].y -= mean_y;
+    norm += d[i]*x[i].x*x[i].x;
+  }
+  norm = sqrt(norm);
+  double dot = 0;
+  for (int l = 0; l < world->nlive; ++l) {
+    int i = world->live[l];
+    x[i].x /= norm;
+    dot += d[i]*x[i].x*x[i].y;
+  }
+  norm = 0;
+  for (int l = 0; l < world->nlive; ++l) {
+    int i = world->live[l];
+    x[i].y -= dot*x[i].x;
+    norm += d[i]*x[i].y*x[i].y;
+  }
+  norm = sqrt(norm);
+  for (int l = 0; l < world->nlive; ++l)
+    x[world->live[l]].y /= norm;
+}
+
+void spectral_start(struct world *world)
+{
+  struct spectral spectral = {
+    .world = world
+  };
+  struct work_phase ops = {
+    .work = &product_work
+  };
+  if (world->nlive < 3)
+    return;
+  spectral.cur = malloc(world->nitems*sizeof(struct pair));
+  spectral.next = malloc(world->nitems*sizeof(struct pair));
+  spectral.degree = malloc(world->nitems*sizeof(double));
+
+  struct rng rng;
+  rng_seed(&rng, world->options->seed, 0x5bec, 0);
+  for (int i = 0; i < world->nitems; ++i) {
+    spectral.degree[i] = 0;
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k)
+      spectral.degree[i] += world->adj[k].weight;
+  }
+  for (int l = 0; l < world->nlive; ++l) {
+    int i = world->live[l];
+    spectral.next[i].x = rng_double(&rng)-0.5;
+    spectral.next[i].y = rng_double(&rng)-0.5;
+  }
+  orthonormalize(world, &spectral);
+
+  int round;
+  for (round = 0; round < SPECTRAL_ROUNDS; ++round) {
+    struct pair *swap = spectral.cur;
+    spectral.cur = spectral.next;
+    spectral.next = swap;
+    give_work(world->pool, &ops, &spectral, world->world_work);
+    orthonormalize(world, &spectral);
+    double change = 0;
+    for (int l = 0; l < world->nlive; ++l) {
+      int i = world->live[l];
+      double dx = spectral.next[i].x-spectral.cur[i].x, dy = spectral.next[i].y-spectral.cur[i].y;
+      change += spectral.degree[i]*(dx*dx+dy*dy);
+    }
+    if (sqrt(change) < SPECTRAL_TOLERANCE)
+      break;
+  }
+
+  // Ranks spread the coordinates evenly over a square of the usual size
+  double weight = 0;
+  for (int l = 0; l < world->nlive; ++l)
+    weight += world->vertices[world->live[l]].weight;
+  double side = sqrt(6)*SPECTRAL_SPREAD*sqrt(weight);
+  struct ranked *order = malloc(world->nlive*sizeof(struct ranked));
+  for (int axis = 0; axis < 2; ++axis) {
+    for (int l = 0; l < world->nlive; ++l) {
+      int i = world->live[l];
+      order[l].value = axis ? spectral.next[i].y : spectral.next[i].x;
+      order[l].i = i;
+    }
+    qsort(order, world->nlive, sizeof(struct ranked), ranked_comparator);
+    for (int l = 0; l < world->nlive; ++l) {
+      struct pair *pos = &world->vertices[order[l].i].pos;
+      double at = side*((l+0.5)/world->nlive-0.5);
+      if (axis)
+	pos->y = at+SPECTRAL_JITTER*pos->y;
+      else
+	pos->x = at+SPECTRAL_JITTER*pos->x;
+    }
+  }
+  free(order);
+  if (world->options->verbose)
+    fprintf(stderr, "spectral start after %i products\n", round < SPECTRAL_ROUNDS ? round+1 : round);
+
+  free(spectral.cur);
+  free(spectral.next);
+  free(spectral.degree);
+}
+
+size_t spectral_memory(int nitems)
+{
+  return nitems*(2*sizeof(struct pair)+sizeof(double));
+}
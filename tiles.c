@@ -0,0 +1,398 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "world.h"
+#include "worker.h"
+#include "output.h"
+#include "tiles.h"
+
+/*
+  Level of detail tiles for renderers, written under a directory as
+  LEVEL/X/Y.json next to an index.json giving the bounds.  Level z
+  cuts the bounding square of the live vertices into 2^z by 2^z
+  tiles, X and Y counting from the low corner.  A tile on the deepest
+  level lists its vertices like the main output does.  Tiles above it
+  list the nodes of a quadtree CELL_BITS levels further down, each
+  with its vertex count, total weight and weighted centroid, so a
+  client draws a tile with at most 4^CELL_BITS points and fetches only
+  the tiles in view.
+
+  Vertices are sorted by the Morton code of their cell on the finest
+  level, which makes every quadtree node a contiguous run.
+
+  Tiles of an earlier run in the same directory would be fetched as if
+  they belonged to this one, so index.json and every file of the
+  LEVEL/X/Y.json shape are removed first.  Nothing else in the
+  directory is touched, and index.json is written last.
+*/
+
+#define CELL_BITS 4
+#define TILE_BATCH 16
+// Upper bounds of one formatted node and vertex
+#define NODE_MAXLEN 160
+#define TILE_VERTEX_MAXLEN 160
+
+struct keyed {
+  uint64_t key;
+  int i;
+};
+
+struct tile {
+  int level;
+  unsigned x, y;
+  int start, end;	// in the sorted vertices
+};
+
+struct tiles {
+  struct world *world;
+  const char *dir;
+  struct keyed *sorted;
+  int bits;		// per axis on the finest level
+  double minx, miny, scale;	// finest cells per unit
+  int levels;
+};
+
+struct tile_work {
+  struct tile *tiles;
+  int ntiles;
+};
+
+static uint64_t spread_bits(uint32_t v)
+{
+  uint64_t x = v;
+  x = (x | x << 16) & 0x0000FFFF0000FFFFULL;
+  x = (x | x << 8) & 0x00FF00FF00FF00FFULL;
+  x = (x | x << 4) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | x << 2) & 0x3333333333333333ULL;
+  x = (x | x << 1) & 0x5555555555555555ULL;
+  return x;
+}
+
+static uint32_t gather_bits(uint64_t x)
+{
+  x &= 0x5555555555555555ULL;
+  x = (x | x >> 1) & 0x3333333333333333ULL;
+  x = (x | x >> 2) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | x >> 4) & 0x00FF00FF00FF00FFULL;
+  x = (x | x >> 8) & 0x0000FFFF0000FFFFULL;
+  x = (x | x >> 16) & 0x00000000FFFFFFFFULL;
+  return x;
+}
+
+static uint32_t cell(double value, double min, double scale, int bits)
+{
+  double c = (value-min)*scale;
+  uint32_t top = (1U << bits)-1;
+  return c <= 0 ? 0 : c >= top ? top : (uint32_t)c;
+}
+
+static void key_work(void *cfg, void *data)
+{
+  struct tiles *tiles = cfg;
+  struct world_work *work = data;
+  struct world *world = tiles->world;
+  for (int i = work->start; i < work->end; ++i) {
+    const struct vertex *v = &world->vertices[i];
+    tiles->sorted[i].i = i;
+    if (v->weight <= 0) {
+      tiles->sorted[i].key = UINT64_MAX;
+      continue;
+    }
+    uint32_t cx = cell(v->pos.x, tiles->minx, tiles->scale, tiles->bits);
+    uint32_t cy = cell(v->pos.y, tiles->miny, tiles->scale, tiles->bits);
+    tiles->sorted[i].key = spread_bits(cx) | spread_bits(cy) << 1;
+  }
+}
+
+static int keyed_comparator(const void *a, const void *b)
+{
+  const struct keyed *k1 = a, *k2 = b;
+  if (k1->key != k2->key)
+    return k1->key < k2->key ? -1 : 1;
+  return k1->i-k2->i;
+}
+
+static char *format_nodes(struct tiles *tiles, const struct tile *tile, char *p)
+{
+  const struct vertex *vertices = tiles->world->vertices;
+  int precision = tiles->world->options->precision;
+  int shift = 2*(tiles->bits-(tile->level+CELL_BITS));
+  p = put_string(p, ",\"nodes\":[");
+  for (int k = tile->start; k < tile->end;) {
+    int first = k == tile->start;
+    uint64_t node = tiles->sorted[k].key >> shift;
+    double weight = 0, x = 0, y = 0;
+    int count = 0;
+    for (; k < tile->end && tiles->sorted[k].key >> shift == node; ++k, ++count) {
+      const struct vertex *v = &vertices[tiles->sorted[k].i];
+      weight += v->weight;
+      x += v->pos.x*v->weight;
+      y += v->pos.y*v->weight;
+    }
+    p = put_string(p, first ? "{\"x\":" : ",{\"x\":");
+    p = put_real(p, x/weight, precision);
+    p = put_string(p, ",\"y\":");
+    p = put_real(p, y/weight, precision);
+    p = put_string(p, ",\"weight\":");
+    p = put_int(p, (long long)weight);
+    p = put_string(p, ",\"count\":");
+    p = put_int(p, count);
+    *p++ = '}';
+  }
+  return put_string(p, "]}\n");
+}
+
+static char *format_vertices(struct tiles *tiles, const struct tile *tile, char *p)
+{
+  const struct world *world = tiles->world;
+  int precision = world->options->precision;
+  p = put_string(p, ",\"vertices\":{");
+  for (int k = tile->start; k < tile->end; ++k) {
+    int i = tiles->sorted[k].i;
+    const struct vertex *v = &world->vertices[i];
+    p = put_string(p, k == tile->start ? "\"" : ",\"");
+    p = put_int(p, world->mapping[i+1]);
+    p = put_string(p, "\":{\"x\":");
+    p = put_real(p, v->pos.x, precision);
+    p = put_string(p, ",\"y\":");
+    p = put_real(p, v->pos.y, precision);
+    p = put_string(p, ",\"radius\":");
+    p = put_real(p, v->radius, precision);
+    p = put_string(p, ",\"weight\":");
+    p = put_int(p, (long long)v->weight);
+    *p++ = '}';
+  }
+  return put_string(p, "}}\n");
+}
+
+static void make_dir(const char *path)
+{
+  if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+// Whether name is a decimal number followed by suffix
+static int numbered(const char *name, const char *suffix)
+{
+  if (!isdigit((unsigned char)*name))
+    return 0;
+  while (isdigit((unsigned char)*name))
+    ++name;
+  return !strcmp(name, suffix);
+}
+
+// Removes the tiles under path, depth 0 being the directory itself
+static void clear_tiles(const char *path, int depth)
+{
+  DIR *d = opendir(path);
+  struct dirent *entry;
+  if (!d)
+    return;
+  size_t len = strlen(path);
+  char *child = malloc(len+NAME_MAX+2);
+  while ((entry = readdir(d))) {
+    if (!numbered(entry->d_name, depth == 2 ? ".json" : ""))
+      continue;
+    sprintf(child, "%s/%s", path, entry->d_name);
+    if (depth == 2) {
+      unlink(child);
+    } else {
+      clear_tiles(child, depth+1);
+      // Fails when something else lives there, which then stays
+      rmdir(child);
+    }
+  }
+  free(child);
+  closedir(d);
+}
+
+static void write_file(const char *path, char *buf, size_t len)
+{
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  write_all(fd, &iov, 1, path);
+  if (close(fd) < 0) {
+    fprintf(stderr, "forcelayout: %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+static void tile_work(void *cfg, void *data)
+{
+  struct tiles *tiles = cfg;
+  struct tile_work *work = data;
+  size_t pathlen = strlen(tiles->dir)+40;
+  char *path = malloc(pathlen);
+  for (struct tile *tile = work->tiles; tile < work->tiles+work->ntiles; ++tile) {
+    int leaf = tile->level == tiles->levels-1;
+    size_t maxlen = 128+(leaf ? (size_t)(tile->end-tile->start)*TILE_VERTEX_MAXLEN
+			 : (size_t)(tile->end-tile->start < 1 << 2*CELL_BITS ? tile->end-tile->start : 1 << 2*CELL_BITS)*NODE_MAXLEN);
+    char *buf = malloc(maxlen), *p = buf;
+    p = put_string(p, "{\"level\":");
+    p = put_int(p, tile->level);
+    p = put_string(p, ",\"x\":");
+    p = put_int(p, tile->x);
+    p = put_string(p, ",\"y\":");
+    p = put_int(p, tile->y);
+    p = leaf ? format_vertices(tiles, tile, p) : format_nodes(tiles, tile, p);
+
+    snprintf(path, pathlen, "%s/%i/%u", tiles->dir, tile->level, tile->x);
+    make_dir(path);
+    snprintf(path, pathlen, "%s/%i/%u/%u.json", tiles->dir, tile->level, tile->x, tile->y);
+    write_file(path, buf, p-buf);
+    free(buf);
+  }
+  free(path);
+}
+
+// Sort keys and the tile list, the tile buffers are transient
+size_t tiles_memory(int nitems, int levels)
+{
+  return (size_t)nitems*(sizeof(struct keyed)+levels*sizeof(struct tile));
+}
+
+void write_tiles(struct world *world, const char *dir)
+{
+  struct tiles tiles = {
+    .world = world,
+    .dir = dir,
+    .levels = world->options->tile_levels,
+    .bits = world->options->tile_levels-1+CELL_BITS
+  };
+  double maxx = 0, maxy = 0;
+  int nlive = 0;
+
+  tiles.minx = tiles.miny = 0;
+  for (int i = 0; i < world->nitems; ++i) {
+    const struct vertex *v = &world->vertices[i];
+    if (v->weight <= 0)
+      continue;
+    if (!nlive++ || v->pos.x < tiles.minx)
+      tiles.minx = v->pos.x;
+    if (nlive == 1 || v->pos.y < tiles.miny)
+      tiles.miny = v->pos.y;
+    if (nlive == 1 || v->pos.x > maxx)
+      maxx = v->pos.x;
+    if (nlive == 1 || v->pos.y > maxy)
+      maxy = v->pos.y;
+  }
+  double size = maxx-tiles.minx > maxy-tiles.miny ? maxx-tiles.minx : maxy-tiles.miny;
+  if (size <= 0)
+    size = 1;
+  tiles.scale = (1U << tiles.bits)/size;
+
+  struct work_phase key_ops = {
+    .work = &key_work
+  };
+  tiles.sorted = malloc(world->nitems*sizeof(struct keyed));
+  give_work(world->pool, &key_ops, &tiles, world->world_work);
+  qsort(tiles.sorted, world->nitems, sizeof(struct keyed), keyed_comparator);
+
+  // Every non-empty tile on every level is a run of the sorted vertices
+  int ntiles = 0, capacity = 1024;
+  struct tile *list = malloc(capacity*sizeof(struct tile));
+  for (int level = 0; level < tiles.levels; ++level) {
+    int shift = 2*(tiles.bits-level);
+    for (int k = 0; k < nlive;) {
+      uint64_t node = tiles.sorted[k].key >> shift;
+      int start = k;
+      while (k < nlive && tiles.sorted[k].key >> shift == node)
+	++k;
+      if (ntiles == capacity)
+	list = realloc(list, (capacity *= 2)*sizeof(struct tile));
+      struct tile tile = {
+	.level = level,
+	.x = gather_bits(node),
+	.y = gather_bits(node >> 1),
+	.start = start,
+	.end = k
+      };
+      list[ntiles++] = tile;
+    }
+  }
+
+  char *path = malloc(strlen(dir)+40);
+  make_dir(dir);
+  sprintf(path, "%s/index.json", dir);
+  unlink(path);
+  clear_tiles(dir, 0);
+  for (int level = 0; level < tiles.levels; ++level) {
+    sprintf(path, "%s/%i", dir, level);
+    make_dir(path);
+  }
+  int nwork = (ntiles+TILE_BATCH-1)/TILE_BATCH;
+  struct tile_work *array = malloc(nwork*sizeof(struct tile_work));
+  struct tile_work **work = malloc((nwork+1)*sizeof(struct tile_work *));
+  for (int w = 0; w < nwork; ++w) {
+    array[w].tiles = list+w*TILE_BATCH;
+    array[w].ntiles = ntiles-w*TILE_BATCH < TILE_BATCH ? ntiles-w*TILE_BATCH : TILE_BATCH;
+    work[w] = &array[w];
+  }
+  work[nwork] = NULL;
+  struct work_phase tile_ops = {
+    .work = &tile_work
+  };
+  if (nwork)
+    give_work(world->pool, &tile_ops, &tiles, work);
+
+  char index[512], *p = index;
+  int precision = world->options->precision;
+  p = put_string(p, "{\"levels\":");
+  p = put_int(p, tiles.levels);
+  p = put_string(p, ",\"x\":");
+  p = put_real(p, tiles.minx, precision);
+  p = put_string(p, ",\"y\":");
+  p = put_real(p, tiles.miny, precision);
+  p = put_string(p, ",\"size\":");
+  p = put_real(p, size, precision);
+  p = put_string(p, ",\"tiles\":");
+  p = put_int(p, ntiles);
+  p = put_string(p, ",\"vertices\":");
+  p = put_int(p, nlive);
+  p = put_string(p, "}\n");
+  sprintf(path, "%s/index.json", dir);
+  write_file(path, index, p-index);
+
+  free(path);
+  free(work);
+  free(array);
+  free(list);
+  free(tiles.sorted);
+}
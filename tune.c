@@ -0,0 +1,237 @@
+/* Copyright (C) 2013-2014 Kari Pahula
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+   
+   The above copyright notice and this permission notice (including the next
+   paragraph) shall be included in all copies or substantial portions of the
+   Software.
+   
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "world.h"
+#include "force.h"
+#include "worker.h"
+#include "nlist.h"
+#include "tune.h"
+#include "deadline.h"
+
+#define PROBE_STEPS 3
+#define MAXLINE 512
+
+/*
+  Thread count and work unit size that suit a graph depend on its size
+  and on the host: small graphs don't gain from threads and on SMT
+  hosts hyperthreads only slow the floating point bound force loop
+  down.  --autotune times a few world_step calls for candidate thread
+  counts and then for candidate grains with the best thread count, and
+  keeps the fastest.  With --tune-cache the choice is stored per host,
+  engine and size bucket, and later runs skip the probes.  Probing
+  stops at the given time, the choice is then only cached if every
+  candidate got timed.
+*/
+
+struct probe_state {
+  struct pair *pos;
+  double maxmove, repulsioncap;
+  int step;
+};
+
+static const char *engine_names[] = {"direct", "pairwise", "sampled", "mesh"};
+
+void set_workers(struct world *world, int nthreads)
+{
+  if (world->pool && worker_count(world->pool) == nthreads)
+    return;
+  if (world->pool)
+    free_workers(world->pool);
+  world->pool = init_workers(nthreads);
+}
+
+void set_grain(struct world *world, int grain)
+{
+  free_force(world);
+  world->options->grain = grain;
+  init_force(world);
+}
+
+static void save_state(struct world *world, struct probe_state *state)
+{
+  state->pos = malloc(world->nitems*sizeof(struct pair));
+  for (int i = 0; i < world->nitems; ++i)
+    state->pos[i] = world->vertices[i].pos;
+  state->maxmove = world->maxmove;
+  state->repulsioncap = world->repulsioncap;
+  state->step = world->step;
+}
+
+static void restore_state(struct world *world, const struct probe_state *state)
+{
+  for (int i = 0; i < world->nitems; ++i)
+    world->vertices[i].pos = state->pos[i];
+  world->maxmove = state->maxmove;
+  world->repulsioncap = state->repulsioncap;
+  world->step = state->step;
+  world->nlist->valid = 0;
+  if (world->quiet)
+    memset(world->quiet, 0, world->nitems);
+}
+
+// Seconds per step, always from the saved state
+static double probe(struct world *world, const struct probe_state *state)
+{
+  world_step(world);
+  double start = monotonic_time();
+  for (int i = 0; i < PROBE_STEPS; ++i)
+    world_step(world);
+  double elapsed = (monotonic_time()-start)/PROBE_STEPS;
+  restore_state(world, state);
+  return elapsed;
+}
+
+static int size_bucket(const struct world *world)
+{
+  return world->nlive > 1 ? (int)log2(world->nlive) : 0;
+}
+
+static void cache_key(const struct world *world, char *key, size_t len)
+{
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0)
+    strcpy(host, "localhost");
+  host[sizeof(host)-1] = 0;
+  snprintf(key, len, "%s %s %i", host, engine_names[world->options->engine], size_bucket(world));
+}
+
+static int read_cache(const char *path, const char *key, int *threads, int *grain)
+{
+  FILE *file = fopen(path, "r");
+  char line[MAXLINE];
+  size_t keylen = strlen(key);
+  int found = 0;
+  if (!file)
+    return 0;
+  while (fgets(line, sizeof(line), file)) {
+    if (!strncmp(line, key, keylen) && line[keylen] == ' ' &&
+	sscanf(line+keylen, "%i %i", threads, grain) == 2 && *threads > 0 && *grain > 0)
+      found = 1;
+  }
+  fclose(file);
+  return found;
+}
+
+// Replaces the key's line, written to a temporary file and renamed over
+static void write_cache(const char *path, const char *key, int threads, int grain)
+{
+  size_t keylen = strlen(key), pathlen = strlen(path);
+  char *tmppath = malloc(pathlen+8), line[MAXLINE];
+  snprintf(tmppath, pathlen+8, "%s.XXXXXX", path);
+  int fd = mkstemp(tmppath);
+  FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL, *in;
+  if (!out) {
+    fprintf(stderr, "forcelayout: can't write tune cache %s\n", path);
+    free(tmppath);
+    return;
+  }
+  if ((in = fopen(path, "r"))) {
+    while (fgets(line, sizeof(line), in)) {
+      if (strncmp(line, key, keylen) || line[keylen] != ' ')
+	fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %i %i\n", key, threads, grain);
+  if (fclose(out) != 0 || rename(tmppath, path) != 0) {
+    fprintf(stderr, "forcelayout: can't write tune cache %s\n", path);
+    unlink(tmppath);
+  }
+  free(tmppath);
+}
+
+void autotune(struct world *world, double until)
+{
+  struct options *options = world->options;
+  struct probe_state state;
+  char key[MAXLINE/2];
+  int ncpu = sysconf(_SC_NPROCESSORS_ONLN), default_grain = work_grain(options);
+  int best_threads = worker_count(world->pool), best_grain = default_grain;
+  double best = INFINITY;
+  int complete = 1;
+
+  cache_key(world, key, sizeof(key));
+  if (options->tune_cache && read_cache(options->tune_cache, key, &best_threads, &best_grain)) {
+    if (best_threads > MAXTHREADS)
+      best_threads = MAXTHREADS;
+    set_workers(world, best_threads);
+    // All ranks of a cluster must cut the work the same way
+    if (options->ranks > 1)
+      best_grain = default_grain;
+    if (best_grain != default_grain)
+      set_grain(world, best_grain);
+    if (options->verbose)
+      fprintf(stderr, "autotune: cached %i threads, grain %i\n", best_threads, best_grain);
+    return;
+  }
+
+  if (ncpu > MAXTHREADS)
+    ncpu = MAXTHREADS;
+  save_state(world, &state);
+  // Powers of two, half of the cpus (the cores on SMT hosts) and all
+  int candidates[MAXTHREADS+2], ncandidates = 0;
+  for (int t = 1; t < ncpu; t *= 2)
+    candidates[ncandidates++] = t;
+  if (ncpu/2 > 1 && (ncpu/2 & (ncpu/2-1)))
+    candidates[ncandidates++] = ncpu/2;
+  candidates[ncandidates++] = ncpu;
+  for (int c = 0; c < ncandidates && (complete = monotonic_time() < until); ++c) {
+    set_workers(world, candidates[c]);
+    double elapsed = probe(world, &state);
+    if (options->verbose)
+      fprintf(stderr, "autotune: %i threads, grain %i: %f ms/step\n", candidates[c], default_grain, elapsed*1e3);
+    if (elapsed < best) {
+      best = elapsed;
+      best_threads = candidates[c];
+    }
+  }
+
+  set_workers(world, best_threads);
+  // All ranks of a cluster must cut the work the same way
+  for (int grain = 8; complete && options->ranks <= 1 && grain <= 512 && grain/2 < world->nitems; grain *= 2) {
+    if (!(complete = monotonic_time() < until))
+      break;
+    set_grain(world, grain);
+    double elapsed = probe(world, &state);
+    if (options->verbose)
+      fprintf(stderr, "autotune: %i threads, grain %i: %f ms/step\n", best_threads, grain, elapsed*1e3);
+    if (elapsed < best) {
+      best = elapsed;
+      best_grain = grain;
+    }
+  }
+  set_grain(world, best_grain);
+  free(state.pos);
+
+  if (options->verbose)
+    fprintf(stderr, "autotune: using %i threads, grain %i%s\n", best_threads, best_grain,
+	    complete ? "" : ", out of time");
+  if (options->tune_cache && complete)
+    write_cache(options->tune_cache, key, best_threads, best_grain);
+}
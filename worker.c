@@ -30,6 +30,7 @@
 
 struct thread_control {
   int nthreads, nthreads_working;
+  int quit;
   pthread_mutex_t mutex;
   pthread_cond_t work_available, work_taken, work_done;
   pthread_t *threads;
@@ -53,8 +54,10 @@ static void *worker(void *ptr)
   void *job_item;
   pthread_mutex_lock(&control->mutex);
   for (;;) {
-    while (!control->job_item)
+    while (!control->job_item && !control->quit)
       pthread_cond_wait(&control->work_available, &control->mutex);
+    if (control->quit)
+      break;
     job_item = control->job_item;
     control->job_item = NULL;
     if (control->work.init_phase)
@@ -70,15 +73,19 @@ static void *worker(void *ptr)
     --control->nthreads_working;
     pthread_cond_signal(&control->work_done);
   }
+  pthread_mutex_unlock(&control->mutex);
+  free(data);
+  return NULL;
 }
 
 struct thread_control *init_workers(int nthreads)
 {
   struct thread_control *control = malloc(sizeof(struct thread_control));
   control->job_item = NULL;
+  control->quit = 0;
   control->nthreads = nthreads;
   control->nthreads_working = 0;
-  control->threads = malloc(nthreads*sizeof(pthread_t *));
+  control->threads = malloc(nthreads*sizeof(pthread_t));
   pthread_cond_init(&control->work_available, NULL);
   pthread_cond_init(&control->work_taken, NULL);
   pthread_cond_init(&control->work_done, NULL);
@@ -97,6 +104,28 @@ struct thread_control *init_workers(int nthreads)
   return control;
 }
 
+// Stops the threads once they are idle and frees the pool
+void free_workers(struct thread_control *control)
+{
+  pthread_mutex_lock(&control->mutex);
+  control->quit = 1;
+  pthread_cond_broadcast(&control->work_available);
+  pthread_mutex_unlock(&control->mutex);
+  for (int t = 0; t < control->nthreads; ++t)
+    pthread_join(control->threads[t], NULL);
+  pthread_cond_destroy(&control->work_available);
+  pthread_cond_destroy(&control->work_taken);
+  pthread_cond_destroy(&control->work_done);
+  pthread_mutex_destroy(&control->mutex);
+  free(control->threads);
+  free(control);
+}
+
+int worker_count(const struct thread_control *control)
+{
+  return control->nthreads;
+}
+
 void give_work(struct thread_control *control, struct work_phase *phase, void *arg, void *work)
 {
   pthread_mutex_lock(&control->mutex);
@@ -108,6 +137,9 @@ void give_work(struct thread_control *control, struct work_phase *phase, void *a
     control->job_item = *ptr;
     pthread_cond_signal(&control->work_available);
   }
+  // The last item has to be picked up before waiting for workers
+  while (control->job_item != NULL)
+    pthread_cond_wait(&control->work_taken, &control->mutex);
   while (control->nthreads_working > 0)
     pthread_cond_wait(&control->work_done, &control->mutex);
   pthread_mutex_unlock(&control->mutex);
@@ -26,6 +26,8 @@
 struct thread_control;
 
 struct thread_control *init_workers(int);
+void free_workers(struct thread_control *);
+int worker_count(const struct thread_control *);
 
 struct work_phase {
   void (*init_phase)(void *, void *);	// has mutex
@@ -32,44 +32,140 @@
 #include <math.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <getopt.h>
 
 #define ITERATIONS 1000
-#define MAXTHREADS 16
 
 #include "world.h"
 #include "force.h"
 #include "adjust.h"
 #include "worker.h"
 #include "sparsify.h"
-
-struct options {
-  int threads;
-  int verbose;
-  const char *output;
-  const char *initial_positions;
-  int iterations;
-  const char *rotate_to;
-};
+#include "output.h"
+#include "tune.h"
+#include "deadline.h"
+#include "ensemble.h"
+#include "cluster.h"
+#include "tiles.h"
+#include "metrics.h"
+#include "mesh.h"
+#include "spectral.h"
+#include "cache.h"
+#include "prune.h"
+#include "grid.h"
+#include "pairwise.h"
+#include "sampled.h"
+#include "nlist.h"
+#include "memory.h"
+#include "idindex.h"
 
 static void inc_weight(struct world *world, int i, int j)
 {
   struct edge *edge = world->edges + i + j*world->nitems;
-  ++edge->weight;
+  if (edge->weight < UINT16_MAX)
+    ++edge->weight;
   edge = world->edges + j + i*world->nitems;
-  ++edge->weight;
+  if (edge->weight < UINT16_MAX)
+    ++edge->weight;
+}
+
+// Rows of the dense matrix as adjacency lists, sorted by j
+static void dense_adjacency(struct world *world)
+{
+  int nedges = 0;
+  world->adj_start = malloc((world->nitems+1)*sizeof(int));
+  for (int i = 0; i < world->nitems; ++i) {
+    struct edge *edge = world->edges+i*world->nitems;
+    for (int j = 0; j < world->nitems; ++j) {
+      if (edge[j].weight > 0 && i != j)
+	++nedges;
+    }
+  }
+  world->adj = malloc(nedges*sizeof(struct adjacency));
+  nedges = 0;
+  for (int i = 0; i < world->nitems; ++i) {
+    world->adj_start[i] = nedges;
+    struct edge *edge = world->edges+i*world->nitems;
+    for (int j = 0; j < world->nitems; ++j) {
+      if (edge[j].weight > 0 && i != j) {
+	world->adj[nedges].j = j;
+	world->adj[nedges++].weight = edge[j].weight;
+      }
+    }
+  }
+  world->adj_start[world->nitems] = nedges;
 }
 
-static void count_edge_closure(int nitems, struct edge *edges, char *closure_map, int i)
+static int pair_comparator(const void *p1, const void *p2)
 {
-  struct edge *edge = edges+i*nitems;
-  closure_map[i] = 1;
-  for (int j = 0; j < nitems; ++j, ++edge) {
-    if (i == j)
+  unsigned long long k1 = *(const unsigned long long *)p1, k2 = *(const unsigned long long *)p2;
+  return k1 < k2 ? -1 : k1 > k2;
+}
+
+/*
+  Adjacency lists straight from the picks, without the dense matrix.
+  Each pair i < j is a key i*nitems+j, after sorting equal keys are
+  counted up as the weight.  Rows come out sorted by j: row r first
+  gets its i < r entries in order and then its j > r entries.
+*/
+static void sparse_adjacency(struct world *world, unsigned long long *pairs, size_t npairs)
+{
+  unsigned long long n = world->nitems;
+  size_t k, nedges = 0;
+  qsort(pairs, npairs, sizeof(unsigned long long), pair_comparator);
+  int *degree = calloc(world->nitems+1, sizeof(int));
+  for (k = 0; k < npairs; ++k) {
+    if (k > 0 && pairs[k] == pairs[k-1])
       continue;
-    if (edge->weight > 0 && !closure_map[j]) {
-      count_edge_closure(nitems, edges, closure_map, j);
+    ++degree[pairs[k]/n];
+    ++degree[pairs[k]%n];
+    nedges += 2;
+  }
+  world->adj_start = malloc((world->nitems+1)*sizeof(int));
+  world->adj = malloc(nedges*sizeof(struct adjacency));
+  world->adj_start[0] = 0;
+  for (int i = 0; i < world->nitems; ++i) {
+    world->adj_start[i+1] = world->adj_start[i]+degree[i];
+    degree[i] = world->adj_start[i];
+  }
+  for (k = 0; k < npairs;) {
+    size_t l = k;
+    while (l < npairs && pairs[l] == pairs[k])
+      ++l;
+    int i = pairs[k]/n, j = pairs[k]%n;
+    float weight = l-k < UINT16_MAX ? l-k : UINT16_MAX;
+    struct adjacency a = { .j = j, .weight = weight }, b = { .j = i, .weight = weight };
+    world->adj[degree[i]++] = a;
+    world->adj[degree[j]++] = b;
+    k = l;
+  }
+  free(degree);
+}
+
+// Vertices not connected to root get a weight of -INFINITY
+static void mark_closure(struct world *world, int root)
+{
+  char *closure_map = calloc(world->nitems, sizeof(char));
+  int *queue = malloc(world->nitems*sizeof(int)), head = 0, tail = 0;
+  closure_map[root] = 1;
+  queue[tail++] = root;
+  while (head < tail) {
+    int i = queue[head++];
+    for (int k = world->adj_start[i]; k < world->adj_start[i+1]; ++k) {
+      int j = world->adj[k].j;
+      if (!closure_map[j]) {
+	closure_map[j] = 1;
+	queue[tail++] = j;
+      }
     }
   }
+  for (int i = 0; i < world->nitems; ++i) {
+    if (!closure_map[i]) {
+      world->vertices[i].weight = -INFINITY;
+    }
+  }
+  free(queue);
+  free(closure_map);
 }
 
 static int key_comparator(const void *k1, const void *k2)
@@ -83,7 +179,7 @@ void init_world(struct world *world, json_t *json) {
   struct vertex *ptr;
   int i = 0;
   int mult = 0;
-  int heaviestitem, maxweight = 0;
+  int heaviest = 0, maxweight = 0;
   int nthreads;
   const char **keys;
 
@@ -96,30 +192,36 @@ void init_world(struct world *world, json_t *json) {
     nthreads = world->options->threads;
 
   world->pool = init_workers(nthreads);
+  world->cluster = NULL;
+  world->step = 0;
   world->maxmove = 30;
+  world->cooling = COOLING;
   world->repulsioncap = 10;
   world->nitems = json_object_size(items);
-  world->edges = calloc(world->nitems*world->nitems, sizeof(struct edge));
-  world->mapping = malloc((1+world->nitems)*sizeof(int));
+  world->mapping = malloc((1+world->nitems)*sizeof(int64_t));
   ptr = world->vertices = malloc(world->nitems*sizeof(struct vertex));
-  world->maxid = 0;
   keys = malloc((world->nitems+1)*sizeof(char *));
   keys[world->nitems] = NULL;
   json_object_foreach (items, key, c) {
     keys[i++] = key;
-    int id = atoi(key);
-    world->maxid = id > world->maxid ? id : world->maxid;
   }
-  world->r_mapping = malloc((1+world->maxid)*sizeof(int));
+  size_t npairs = 0;
+  json_object_foreach (picks, key, c) {
+    size_t len = json_array_size(c);
+    npairs += len*(len-1)/2;
+  }
+  plan_memory(world, npairs);
+
+  world->ids = new_id_index(world->nitems);
   qsort(&keys[0], world->nitems, sizeof(char *), key_comparator);
 
   for (i = 0; i < world->nitems; ++i) {
     json_t *val = json_object_get(items, keys[i]);
-    int id = atoi(keys[i]);
+    int64_t id = strtoll(keys[i], NULL, 10);
     ptr->weight = 1+json_integer_value(json_object_get(val, "weight"));
     ptr->radius = sqrtf(ptr->weight)/M_PI;
     if (ptr->weight > maxweight) {
-      heaviestitem = id;
+      heaviest = i;
       maxweight = ptr->weight;
     }
 
@@ -128,7 +230,7 @@ void init_world(struct world *world, json_t *json) {
     ptr->pos.y = (mult+8)*10*cos((double)i/world->nitems*2*M_PI);
     ++mult;
     mult %= 16;
-    world->r_mapping[id] = i+1;
+    id_index_put(world->ids, id, i+1);
     world->mapping[i+1] = id;
     ++ptr;
   }
@@ -136,56 +238,78 @@ void init_world(struct world *world, json_t *json) {
     load_world_positions(world, world->vertices, world->options->initial_positions);
   }
 
+  unsigned long long *pairs = NULL;
+  if (world->dense_edges)
+    world->edges = calloc((size_t)world->nitems*world->nitems, sizeof(struct edge));
+  else {
+    world->edges = NULL;
+    pairs = malloc(npairs*sizeof(unsigned long long));
+    npairs = 0;
+  }
   json_object_foreach (picks, key, c) {
     for (i = 0; i < json_array_size(c); ++i) {
-      int ref1 = world->r_mapping[json_integer_value(json_array_get(c, i))];
+      int ref1 = id_index_get(world->ids, json_integer_value(json_array_get(c, i)));
       if (ref1) {
 	for (int j = i+1; j < json_array_size(c); ++j) {
-	  int ref2 = world->r_mapping[json_integer_value(json_array_get(c, j))];
-	  if (ref2) {
+	  int ref2 = id_index_get(world->ids, json_integer_value(json_array_get(c, j)));
+	  if (!ref2)
+	    continue;
+	  if (world->edges) {
 	    inc_weight(world, ref1-1, ref2-1);
+	  } else if (ref1 != ref2) {
+	    unsigned long long a = ref1 < ref2 ? ref1-1 : ref2-1, b = ref1 < ref2 ? ref2-1 : ref1-1;
+	    pairs[npairs++] = a*world->nitems+b;
 	  }
 	}
       }
     }
   }
+  if (world->edges) {
+    dense_adjacency(world);
+  } else {
+    sparse_adjacency(world, pairs, npairs);
+    free(pairs);
+  }
+  if (world->options->prune_weight > 0 || world->options->prune_top > 0 || world->options->prune_alpha > 0)
+    prune_edges(world);
 
   // Sanity check: only pick items which are connected to the heaviest item
-  char *closure_map = calloc(world->nitems+1, sizeof(char));
-  count_edge_closure(world->nitems, world->edges, closure_map, world->r_mapping[heaviestitem]-1);
-  for (int i = 0; i < world->nitems; ++i) {
-    if (!closure_map[i]) {
-      world->vertices[i].weight = -INFINITY;
-    }
+  mark_closure(world, heaviest);
+  world->live = malloc(world->nitems*sizeof(int));
+  world->nlive = 0;
+  for (i = 0; i < world->nitems; ++i) {
+    if (world->vertices[i].weight > 0)
+      world->live[world->nlive++] = i;
   }
-  free(closure_map);
 
   world->world_weight_inv = 0;
+  world->maxradius = 0;
   for (i = 0; i < world->nitems; ++i) {
     if (isfinite(world->vertices[i].weight)) {
       world->world_weight_inv += world->vertices[i].weight;
+      if (world->vertices[i].radius > world->maxradius)
+	world->maxradius = world->vertices[i].radius;
     }
   }
   world->world_weight_inv = 1/world->world_weight_inv;
-  init_force(world);
 }
 
-static json_t * world_to_json(struct world *world) {
-  json_t *res = json_object();
-  for (int i = 0; i < world->nitems; ++i) {
-    char id[8];
-    struct vertex *par = &world->vertices[i];
-    if (par->weight <= 0)
-      continue;
-    json_t *comic = json_object();
-    json_object_set_new(comic, "x", json_real(par->pos.x));
-    json_object_set_new(comic, "y", json_real(par->pos.y));
-    json_object_set_new(comic, "radius", json_real(par->radius));
-    json_object_set_new(comic, "weight", json_integer(par->weight));
-    snprintf(id, 8, "%i", world->mapping[i+1]);
-    json_object_set_new(res, id, comic);
-  }
-  return res;
+// The state the layout steps need, set up once the graph is read
+void init_layout(struct world *world) {
+  init_force(world);
+  if (world->options->spectral && !world->options->initial_positions)
+    spectral_start(world);
+  init_freeze(world);
+  init_coefficients(world);
+  init_grid(world);
+  init_sparsify(world);
+  init_nlist(world);
+  if (world->options->engine == ENGINE_PAIRWISE)
+    init_pairwise(world);
+  else if (world->options->engine == ENGINE_SAMPLED)
+    init_sampled(world);
+  else if (world->options->engine == ENGINE_MESH)
+    init_mesh(world);
 }
 
 void load_world_positions(struct world *world, struct vertex *vertices, const char *path) {
@@ -197,10 +321,7 @@ void load_world_positions(struct world *world, struct vertex *vertices, const ch
     exit(1);
   }
   json_object_foreach(positions, key, pos) {
-    int keyval = atoi(key);
-    if (keyval > world->maxid)
-      continue;
-    int rid = world->r_mapping[atoi(key)];
+    int rid = id_index_get(world->ids, strtoll(key, NULL, 10));
     if (rid != 0) {
       struct vertex *par = &vertices[rid-1];
       par->pos.x = json_real_value(json_object_get(pos, "x"));
@@ -214,11 +335,22 @@ void load_world_positions(struct world *world, struct vertex *vertices, const ch
 
 
 static void usage() {
-  fprintf(stderr, "usage: forcelayout [-j threads] [-i iterations] [-r reference] [-q] input.json output.json\n");
+  fprintf(stderr, "usage: forcelayout [-j threads] [-i iterations] [-r reference] [-q]\n"
+	  "                   [--compact] [--precision digits] [--engine direct|pairwise|sampled|mesh]\n"
+	  "                   [--samples k] [--seed n] [--memory-budget bytes[KMG]]\n"
+	  "                   [--grain n] [--autotune] [--tune-cache file] [--deadline seconds]\n"
+	  "                   [--ensemble k] [--freeze distance]\n"
+	  "                   [--ranks n --rank i --cluster unix:path|host:port]\n"
+	  "                   [--tiles directory] [--tile-levels n] [--metrics file]\n"
+	  "                   [--mesh cells] [--spectral]\n"
+	  "                   [--cache directory] [--cache-size bytes[KMG]]\n"
+	  "                   [--prune-weight w] [--prune-top k] [--prune-alpha a]\n"
+	  "                   input.json output.json\n");
   exit(1);
 }
 
 int main(int argc, char *argv[]) {
+  double start = monotonic_time();
   double energy;
   size_t len;
   json_t *json;
@@ -229,10 +361,90 @@ int main(int argc, char *argv[]) {
     .output = NULL,
     .initial_positions = NULL,
     .iterations = 0,
-    .rotate_to = NULL
+    .rotate_to = NULL,
+    .compact = 0,
+    .precision = 0,
+    .engine = ENGINE_DIRECT,
+    .samples = 64,
+    .seed = 0,
+    .memory_budget = 0,
+    .grain = 0,
+    .autotune = 0,
+    .tune_cache = NULL,
+    .deadline = 0,
+    .ensemble = 1,
+    .freeze = 0,
+    .ranks = 1,
+    .rank = 0,
+    .cluster = NULL,
+    .tiles = NULL,
+    .tile_levels = 8,
+    .metrics = NULL,
+    .mesh = 0,
+    .spectral = 0,
+    .cache = NULL,
+    .cache_size = (size_t)256 << 20,
+    .prune_weight = 0,
+    .prune_top = 0,
+    .prune_alpha = 0
+  };
+  enum {
+    OPT_COMPACT = 256,
+    OPT_PRECISION,
+    OPT_ENGINE,
+    OPT_SAMPLES,
+    OPT_SEED,
+    OPT_MEMORY_BUDGET,
+    OPT_GRAIN,
+    OPT_AUTOTUNE,
+    OPT_TUNE_CACHE,
+    OPT_DEADLINE,
+    OPT_ENSEMBLE,
+    OPT_FREEZE,
+    OPT_RANKS,
+    OPT_RANK,
+    OPT_CLUSTER,
+    OPT_TILES,
+    OPT_TILE_LEVELS,
+    OPT_METRICS,
+    OPT_MESH,
+    OPT_SPECTRAL,
+    OPT_CACHE,
+    OPT_CACHE_SIZE,
+    OPT_PRUNE_WEIGHT,
+    OPT_PRUNE_TOP,
+    OPT_PRUNE_ALPHA
+  };
+  static const struct option long_options[] = {
+    {"compact", no_argument, NULL, OPT_COMPACT},
+    {"precision", required_argument, NULL, OPT_PRECISION},
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"samples", required_argument, NULL, OPT_SAMPLES},
+    {"seed", required_argument, NULL, OPT_SEED},
+    {"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+    {"grain", required_argument, NULL, OPT_GRAIN},
+    {"autotune", no_argument, NULL, OPT_AUTOTUNE},
+    {"tune-cache", required_argument, NULL, OPT_TUNE_CACHE},
+    {"deadline", required_argument, NULL, OPT_DEADLINE},
+    {"ensemble", required_argument, NULL, OPT_ENSEMBLE},
+    {"freeze", required_argument, NULL, OPT_FREEZE},
+    {"ranks", required_argument, NULL, OPT_RANKS},
+    {"rank", required_argument, NULL, OPT_RANK},
+    {"cluster", required_argument, NULL, OPT_CLUSTER},
+    {"tiles", required_argument, NULL, OPT_TILES},
+    {"tile-levels", required_argument, NULL, OPT_TILE_LEVELS},
+    {"metrics", required_argument, NULL, OPT_METRICS},
+    {"mesh", required_argument, NULL, OPT_MESH},
+    {"spectral", no_argument, NULL, OPT_SPECTRAL},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+    {"prune-weight", required_argument, NULL, OPT_PRUNE_WEIGHT},
+    {"prune-top", required_argument, NULL, OPT_PRUNE_TOP},
+    {"prune-alpha", required_argument, NULL, OPT_PRUNE_ALPHA},
+    {NULL, 0, NULL, 0}
   };
   int opt;
-  while ((opt = getopt(argc, argv, "j:p:i:qr:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "j:p:i:qr:", long_options, NULL)) != -1) {
     switch (opt) {
     case 'j':
       options.threads = atoi(optarg);
@@ -249,6 +461,119 @@ int main(int argc, char *argv[]) {
     case 'i':
       options.iterations = atoi(optarg);
       break;
+    case OPT_COMPACT:
+      options.compact = 1;
+      break;
+    case OPT_PRECISION:
+      options.precision = atoi(optarg);
+      if (options.precision < 1 || options.precision > 17)
+	usage();
+      break;
+    case OPT_ENGINE:
+      if (!strcmp(optarg, "direct"))
+	options.engine = ENGINE_DIRECT;
+      else if (!strcmp(optarg, "pairwise"))
+	options.engine = ENGINE_PAIRWISE;
+      else if (!strcmp(optarg, "sampled"))
+	options.engine = ENGINE_SAMPLED;
+      else if (!strcmp(optarg, "mesh"))
+	options.engine = ENGINE_MESH;
+      else
+	usage();
+      break;
+    case OPT_SAMPLES:
+      options.samples = atoi(optarg);
+      if (options.samples <= 0)
+	usage();
+      break;
+    case OPT_SEED:
+      options.seed = strtoul(optarg, NULL, 0);
+      break;
+    case OPT_MEMORY_BUDGET:
+      options.memory_budget = parse_size(optarg);
+      if (!options.memory_budget)
+	usage();
+      break;
+    case OPT_GRAIN:
+      options.grain = atoi(optarg);
+      if (options.grain <= 0)
+	usage();
+      break;
+    case OPT_AUTOTUNE:
+      options.autotune = 1;
+      break;
+    case OPT_TUNE_CACHE:
+      options.tune_cache = optarg;
+      options.autotune = 1;
+      break;
+    case OPT_DEADLINE:
+      options.deadline = atof(optarg);
+      if (options.deadline <= 0)
+	usage();
+      break;
+    case OPT_ENSEMBLE:
+      options.ensemble = atoi(optarg);
+      if (options.ensemble < 1 || options.ensemble > MAXTHREADS)
+	usage();
+      break;
+    case OPT_FREEZE:
+      options.freeze = atof(optarg);
+      if (options.freeze <= 0)
+	usage();
+      break;
+    case OPT_RANKS:
+      options.ranks = atoi(optarg);
+      if (options.ranks < 1)
+	usage();
+      break;
+    case OPT_RANK:
+      options.rank = atoi(optarg);
+      break;
+    case OPT_CLUSTER:
+      options.cluster = optarg;
+      break;
+    case OPT_TILES:
+      options.tiles = optarg;
+      break;
+    case OPT_TILE_LEVELS:
+      options.tile_levels = atoi(optarg);
+      if (options.tile_levels < 1 || options.tile_levels > 16)
+	usage();
+      break;
+    case OPT_METRICS:
+      options.metrics = optarg;
+      break;
+    case OPT_MESH:
+      options.mesh = atoi(optarg);
+      if (options.mesh < 16 || options.mesh & (options.mesh-1))
+	usage();
+      break;
+    case OPT_SPECTRAL:
+      options.spectral = 1;
+      break;
+    case OPT_CACHE:
+      options.cache = optarg;
+      break;
+    case OPT_CACHE_SIZE:
+      options.cache_size = parse_size(optarg);
+      if (!options.cache_size)
+	usage();
+      break;
+    case OPT_PRUNE_WEIGHT:
+      options.prune_weight = atof(optarg);
+      if (options.prune_weight < 0)
+	usage();
+      break;
+    case OPT_PRUNE_TOP:
+      options.prune_top = atoi(optarg);
+      if (options.prune_top < 1)
+	usage();
+      break;
+    case OPT_PRUNE_ALPHA:
+      options.prune_alpha = atof(optarg);
+      if (options.prune_alpha <= 0 || options.prune_alpha > 1)
+	usage();
+      break;
     default:
       usage();
     }
@@ -256,14 +581,49 @@ int main(int argc, char *argv[]) {
 
   if (optind+2 != argc)
     usage();
+  if (options.ranks > 1 && (!options.cluster || options.rank < 0 || options.rank >= options.ranks))
+    usage();
+  if (options.ranks > 1 && (options.engine == ENGINE_PAIRWISE || options.engine == ENGINE_MESH ||
+			    options.ensemble > 1 || options.deadline || options.freeze || options.cache)) {
+    fprintf(stderr, "forcelayout: --ranks works with the direct and sampled engines only, "
+	    "without --ensemble, --deadline, --freeze or --cache\n");
+    exit(1);
+  }
+  // A spectral start needs no untangling, so its default schedule is shorter
+  int short_schedule = options.iterations <= 0 && options.spectral;
   if (options.iterations <= 0)
-    options.iterations = ITERATIONS;
+    options.iterations = short_schedule ? SPECTRAL_ITERATIONS : ITERATIONS;
   json = json_load_file(argv[optind], 0, NULL);
   options.output = argv[optind+1];
   assert(json_is_object(json));
 
   world.options = &options;
   init_world(&world, json);
+  // Cools down to where the full schedule would end
+  if (short_schedule)
+    world.cooling = pow(COOLING, (double)ITERATIONS/SPECTRAL_ITERATIONS);
+  // Finished layouts come straight from the cache, before any of the
+  // layout state is set up
+  struct cache_key key;
+  int cached = 0, aligned = 0;
+  if (options.cache) {
+    cache_key(&world, &key);
+    cached = cache_load(&world, &key, &aligned);
+    if (cached && options.verbose)
+      fprintf(stderr, "forcelayout: layout %s from the cache\n", key.hex);
+  }
+  if (!cached)
+    init_layout(&world);
+  else if (options.metrics)
+    init_grid(&world);
+  if (options.autotune && !cached)
+    autotune(&world, options.deadline ? deadline_tune_end(&options, start) : INFINITY);
+  if (options.ranks > 1) {
+    init_cluster(&world);
+    // Only rank 0 gets past the force steps
+    if (options.rank != 0)
+      options.rotate_to = NULL;
+  }
   pthread_t rotate_loader_thread;
   struct compare_init compare_init;
   if (options.rotate_to) {
@@ -272,32 +632,82 @@ int main(int argc, char *argv[]) {
     pthread_create(&rotate_loader_thread, NULL, compare_initer, &compare_init);
   }
 
+  const struct vertex *reference = NULL;
+  if (cached)
+    goto laid_out;
+
+  int first = 0;
+  if (options.ensemble > 1)
+    first = run_ensemble(&world, options.deadline ? deadline_ensemble_end(&options, start) : INFINITY);
+  struct deadline deadline;
+  if (options.deadline)
+    init_deadline(&deadline, &world, start, options.iterations-first);
+
   // Main force-directed graph algorithm
-  for (int i = 0; i < options.iterations; ++i) {
+  for (int i = first; i < options.iterations; ++i) {
 #ifdef DEBUG
     char tmpname[100];
     snprintf(tmpname, 100, "/tmp/world%i.json", i);
-    json_dump_file(world_to_json(&world), tmpname, JSON_INDENT(2));
+    write_world(&world, tmpname);
 #endif
+    if (options.deadline && !deadline_force_step(&deadline, &world))
+      break;
     energy = world_step(&world);
-    if (options.verbose)
+    if (options.verbose && options.freeze)
+      fprintf(stderr, "%i forces %f, %i frozen\n", i, energy, world.nfrozen);
+    else if (options.verbose)
       fprintf(stderr, "%i forces %f\n", i, energy);
   }
 
+  if (world.cluster) {
+    free_cluster(&world);
+    if (options.rank != 0)
+      return 0;
+  }
+
   sparsify_world(&world);
+  // Stays positive if the deadline stops the overlap loop early
+  energy = INFINITY;
   do {
+    if (options.deadline && !deadline_sparsify_step(&deadline, &world))
+      break;
     energy = sparsify_step(&world);
+    if (options.deadline)
+      deadline_sparsified(&deadline, energy);
     if (options.verbose)
       fprintf(stderr, "overlap %f\n", energy);
   } while (energy > 0);
+  if (options.deadline)
+    deadline_finish_sparsify(&deadline, &world);
 
   if (options.rotate_to) {
     void *retval;
     struct compare_data *compare_data;
     pthread_join(rotate_loader_thread, &retval);
     compare_data = retval;
-    compare_world(compare_data);
+    reference = compare_reference(compare_data);
+    if (!options.deadline || deadline_align(&deadline)) {
+      compare_world(compare_data);
+      aligned = 1;
+    }
   }
 
-  json_dump_file(world_to_json(&world), options.output, JSON_INDENT(2));
+  if (options.deadline && (options.verbose || !deadline_complete(&deadline, &world)))
+    deadline_report(&deadline, &world);
+  // Only a finished layout is what the key stands for
+  if (options.cache && energy <= 0 && (!options.deadline || deadline_complete(&deadline, &world)))
+    cache_store(&world, &key, aligned);
+
+ laid_out:
+  // Cached positions are already aligned, the reference is only for the metrics
+  if (cached && options.rotate_to) {
+    void *retval;
+    pthread_join(rotate_loader_thread, &retval);
+    reference = compare_reference(retval);
+  }
+  write_world(&world, options.output);
+  if (options.tiles)
+    write_tiles(&world, options.tiles);
+  if (options.metrics)
+    write_metrics(&world, reference, aligned, options.metrics);
 }
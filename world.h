@@ -23,7 +23,11 @@
 #ifndef _WORLD_H
 #define _WORLD_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define RELAX_EXTRA 1
+#define MAXTHREADS 16
 
 struct pair {
   double x, y;
@@ -35,13 +39,62 @@ struct vertex {
   float weight;
 };
 
+// Picks only ever count up, 16 bits halve the dense matrix
 struct edge {
+  uint16_t weight;
+};
+
+// Edge list entry of the adjacency of a vertex
+struct adjacency {
+  int j;
   float weight;
 };
  
+enum engine {
+  ENGINE_DIRECT,	// count_energy per vertex
+  ENGINE_PAIRWISE,	// each pair once, see pairwise.c
+  ENGINE_SAMPLED,	// sampled repulsion, see sampled.c
+  ENGINE_MESH		// particle-mesh repulsion, see mesh.c
+};
+
+struct options {
+  int threads;
+  int verbose;
+  const char *output;
+  const char *initial_positions;
+  int iterations;
+  const char *rotate_to;
+  int compact;
+  int precision;	// digits after the decimal point, 0 for shortest
+  enum engine engine;
+  int samples;		// repulsion samples per vertex and step
+  unsigned long seed;
+  size_t memory_budget;	// bytes, 0 for no limit
+  int grain;		// vertices per work unit, 0 for the default
+  int autotune;
+  const char *tune_cache;
+  double deadline;	// seconds, 0 for none
+  int ensemble;		// starts laid out at once, 1 for just the usual
+  double freeze;	// moves below this freeze a vertex, 0 for never
+  int ranks;		// processes sharing the layout
+  int rank;
+  const char *cluster;	// unix:path or host:port of rank 0
+  const char *tiles;	// directory for level of detail tiles, or NULL
+  int tile_levels;
+  const char *metrics;	// file for layout quality metrics, or NULL
+  int mesh;		// cells a side for the mesh engine, 0 for automatic
+  int spectral;		// start from the Laplacian eigenvectors
+  const char *cache;	// directory of finished layouts, or NULL
+  size_t cache_size;	// bytes the cache directory is trimmed to
+  float prune_weight;	// edges lighter than this are dropped, see prune.c
+  int prune_top;	// heaviest edges kept per vertex, 0 for all
+  double prune_alpha;	// disparity filter significance, 0 for none
+};
+
 struct world_work {
   int start, end;
   double energy;
+  double weight;	// secondary sum for phases that need one
   void *extra;
   struct pair data[];
 };
@@ -49,21 +102,51 @@ struct world_work {
 struct world {
   struct thread_control *pool;
   double allforces;
-  struct edge *edges;
+  struct edge *edges;	// dense matrix, NULL if only adjacency is kept
+  int dense_edges;
   struct vertex *vertices;
   double *dist;
-  int *mapping;		//index: internal id > 0
+  int64_t *mapping;	//index: internal id > 0
   int nitems;
-  int maxid;
-  int *r_mapping;	//index: id
+  struct id_index *ids;	// id > internal id
+  int *live;		// vertices connected to the heaviest item
+  int nlive;
+  int *adj_start;	// index: vertex, adjacency of i is adj[adj_start[i]..adj_start[i+1]]
+  struct adjacency *adj;
   double energy;
+  int step;
   double maxmove;
+  double cooling;	// maxmove factor per step
   double repulsioncap;
   double world_weight_inv;
+  float maxradius;
+  struct grid *grid;
+  struct nlist *nlist;
+  struct coefficients *coef;	// constant per vertex and edge terms, see force.c
+  struct pair *live_pos;	// index: live order, gathered every direct step
+  struct pair *force;	// unclamped moves, for engines other than direct
+  struct pairwise *pairwise;
+  struct mesh *mesh;
+  unsigned char *quiet;	// index: vertex, steps it has barely moved, NULL unless freezing
+  unsigned char *moved;	// index: vertex, moved enough on the last step to wake neighbours
+  int sweep;		// this step computes frozen vertices too
+  int nfrozen;		// skipped on the last step
+  unsigned char *active;	// vertices sparsify_step looks at
+  unsigned char *unsettled;	// overlapped on the last step
   struct world_work **world_work;
+  struct world_work **local_work;	// the units this process computes
+  struct cluster *cluster;	// NULL unless --ranks
   struct options *options;
 };
 
+// Weight of edge i-j while walking j upwards along row i of the adjacency
+static inline float adjacency_walk(const struct adjacency **cursor, const struct adjacency *end, int j)
+{
+  while (*cursor < end && (*cursor)->j < j)
+    ++*cursor;
+  return *cursor < end && (*cursor)->j == j ? (*cursor)->weight : 0;
+}
+
 void load_world_positions(struct world *, struct vertex *, const char *);
 
 #endif